@@ -0,0 +1,99 @@
+//
+//   Copyright 2012 Dave Bacon
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+#include "bench.h"
+
+#include <avr/io.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+void USART_UDRE_vect(void);
+
+uint64_t bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compare_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+uint32_t bench_median(uint32_t *t, uint16_t n) {
+	qsort(t, n, sizeof(*t), &compare_u32);
+	return t[n / 2];
+}
+
+// median cost of bench_now() twice, measured on first use
+static uint32_t overhead(void) {
+	static uint32_t ns = 0xffffffff;
+	if (ns == 0xffffffff) {
+		uint32_t t[BENCH_REPS];
+		for (uint16_t i = 0; i < BENCH_REPS; ++i) {
+			uint64_t start = bench_now();
+			t[i] = bench_now() - start;
+		}
+		ns = bench_median(t, BENCH_REPS);
+	}
+	return ns;
+}
+
+uint32_t bench_since(uint64_t start) {
+	uint32_t ns = bench_now() - start;
+	uint32_t o = overhead();
+	return (ns > o) ? ns - o : 0;
+}
+
+static sigset_t transmitter;
+
+uint16_t bench_drain(uint8_t *out, uint16_t max) {
+	sigset_t old;
+	uint16_t n = 0;
+
+	sigprocmask(SIG_BLOCK, &transmitter, &old);
+	// the last call finds the queue empty and clears UDRIE0
+	while (bit_is_set(UCSR0B, UDRIE0)) {
+		USART_UDRE_vect();
+		if (bit_is_clear(UCSR0B, UDRIE0)) break;
+		if (out && n < max) out[n] = UDR0;
+		++n;
+	}
+	sigprocmask(SIG_SETMASK, &old, 0);
+	return n;
+}
+
+static void transmit(int sig) {
+	if (bit_is_set(UCSR0B, UDRIE0)) {
+		USART_UDRE_vect();
+	} else {
+		UCSR0A |= _BV(TXC0); // nothing left to shift out
+	}
+}
+
+void bench_transmitter(uint32_t baud) {
+	struct itimerval period = { { 0, 0 }, { 0, 0 } };
+	period.it_interval.tv_usec = 10 * 1000000 / baud; // start, 8 data, stop
+	period.it_value = period.it_interval;
+
+	sigemptyset(&transmitter);
+	sigaddset(&transmitter, SIGALRM);
+	signal(SIGALRM, &transmit);
+	setitimer(ITIMER_REAL, &period, 0);
+}
@@ -0,0 +1,58 @@
+//
+//   Copyright 2012 Dave Bacon
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+#ifndef __bench_h__
+#define __bench_h__
+
+#include <inttypes.h>
+
+//
+// Timing and transmit helpers for the host benchmarks.
+//
+// Times are host nanoseconds.  They compare builds of the firmware on
+// one machine and say where the cost is; they are not AVR cycles, and
+// don't convert to them.
+//
+
+// printed first by each benchmark
+#define BENCH_UNITS "times in host ns, relative only, not AVR cycles\n"
+
+// Timings per case; the median is reported.
+#define BENCH_REPS (101)
+
+/** monotonic time in ns */
+uint64_t bench_now();
+
+/** ns since start, less the cost of an empty timed region */
+uint32_t bench_since(uint64_t start);
+
+/** median of t[0..n-1], which it sorts */
+uint32_t bench_median(uint32_t *t, uint16_t n);
+
+/**
+ * Runs USART_UDRE_vect until the transmit queue is empty, keeping up
+ * to max of the bytes sent in out, which may be 0.  Returns the number
+ * of bytes sent.
+ */
+uint16_t bench_drain(uint8_t *out, uint16_t max);
+
+/**
+ * Runs USART_UDRE_vect from a timer signal, one byte time at baud, so
+ * code that waits for the transmitter finishes as it would on the car.
+ */
+void bench_transmitter(uint32_t baud);
+
+#endif // __bench_h__
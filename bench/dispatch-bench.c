@@ -0,0 +1,258 @@
+//
+//   Copyright 2012 Dave Bacon
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+//
+// Protocol handler benchmark.
+//
+// Times every byte value through compat dagu, through compat dagu
+// after the escape, and through protocol_1, then replays a command
+// stream in each protocol and reports bytes/sec.  Run with -s for the
+// summary lines only.
+//
+// The firmware is built into this file with its main() renamed, so
+// the static handlers are called as the main loop calls them.  Motor
+// commands end in the mailbox and the stub timer registers.  Each timed
+// byte starts from protocol_select(), and replies are drained from the
+// transmit queue between batches, outside the timed part.
+//
+// Only names the firmware has had since the framed and setpoint
+// protocols went in are used, so older trees build too; see the
+// Makefile's compare target.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define main firmware_main
+#include "open-racer-firmware.c"
+#undef main
+
+#define STREAM_LEN (4096)
+#define STREAM_REPS (21)
+
+static uint8_t summary = 0;
+
+// Bytes timed together, so one byte's cost is well above the clock's
+// resolution.  Fewer when the replies would overflow the transmit
+// queue, and one when a byte takes long anyway.
+#define BATCH_MAX (32)
+#define BATCH_SLOW_NS (100000)
+
+static void start_byte(uint8_t protocol, int16_t prefix) {
+	protocol_select(protocol);
+	if (prefix >= 0) (*handler)(prefix);
+}
+
+// median ns for byte b through protocol, after prefix if it's >= 0:
+// batches of start_byte() and b, less batches of start_byte() alone
+static uint32_t time_byte(uint8_t protocol, int16_t prefix, uint8_t b) {
+	start_byte(protocol, prefix);
+	bench_drain(0, 0);
+	uint64_t start = bench_now();
+	(*handler)(b);
+	uint32_t once = bench_since(start);
+	uint16_t reply = bench_drain(0, 0);
+
+	uint16_t batch = BATCH_MAX;
+	if (reply && batch > (UART_TX_BUFSIZE - 1) / reply) batch = (UART_TX_BUFSIZE - 1) / reply;
+	if (batch == 0 || once > BATCH_SLOW_NS) batch = 1;
+
+	uint32_t t[BENCH_REPS];
+	for (uint16_t r = 0; r < BENCH_REPS; ++r) {
+		start = bench_now();
+		for (uint16_t i = 0; i < batch; ++i) {
+			start_byte(protocol, prefix);
+			(*handler)(b);
+		}
+		uint32_t with = bench_since(start);
+		bench_drain(0, 0);
+
+		start = bench_now();
+		for (uint16_t i = 0; i < batch; ++i) start_byte(protocol, prefix);
+		uint32_t without = bench_since(start);
+		bench_drain(0, 0);
+
+		t[r] = (with > without) ? with - without : 0;
+	}
+	return (bench_median(t, BENCH_REPS) + batch / 2) / batch;
+}
+
+static void bench_bytes(const char *name, uint8_t protocol, int16_t prefix) {
+	uint32_t ns[256];
+	uint8_t worst = 0;
+
+	for (uint16_t b = 0; b < 256; ++b) {
+		ns[b] = time_byte(protocol, prefix, b);
+		if (ns[b] > ns[worst]) worst = b;
+	}
+
+	uint32_t sorted[256];
+	memcpy(sorted, ns, sizeof(ns));
+	uint32_t median = bench_median(sorted, 256);
+	uint32_t p90 = sorted[256 * 9 / 10];
+
+	if (!summary) {
+		printf("%s, ns per byte value (row high nibble, column low)\n     ", name);
+		for (uint8_t c = 0; c < 16; ++c) printf("%7x", c);
+		printf("\n");
+		for (uint8_t row = 0; row < 16; ++row) {
+			printf("  %x_ ", row);
+			for (uint8_t c = 0; c < 16; ++c) printf("%7u", ns[row * 16 + c]);
+			printf("\n");
+		}
+	}
+	printf("%-24s median %4u ns  90%% %5u ns  max %9u ns at 0x%02x\n",
+		name, median, p90, ns[worst], worst);
+	if (!summary) printf("\n");
+}
+
+static void bench_stream(const char *name, uint8_t protocol,
+		const uint8_t *data, uint16_t len, uint16_t messages) {
+	uint32_t t[STREAM_REPS];
+	for (uint16_t r = 0; r < STREAM_REPS; ++r) {
+		protocol_select(protocol);
+		bench_drain(0, 0);
+
+		uint64_t start = bench_now();
+		for (uint16_t i = 0; i < len; ++i) (*handler)(data[i]);
+		t[r] = bench_since(start);
+	}
+	bench_drain(0, 0);
+
+	uint32_t ns = bench_median(t, STREAM_REPS);
+	printf("%-24s %10.0f bytes/s  %6.1f ns/byte  %6.1f ns/message\n",
+		name, len * 1e9 / ns, (double) ns / len, (double) ns / messages);
+}
+
+// A small LCG, so every run replays the same streams.
+static uint32_t seed = 1;
+
+static uint8_t next_random(uint8_t range) {
+	seed = seed * 1103515245u + 12345u;
+	return (seed >> 16) % range;
+}
+
+// Compat dagu as the i-Racer app drives: one direction and speed byte
+// per touch update, repeated while the stick is held.
+static uint16_t stream_compat(uint8_t *out, uint16_t *messages) {
+	uint16_t n = 0;
+	while (n < STREAM_LEN) {
+		uint8_t direction = next_random(9);
+		uint8_t speed = next_random(16);
+		uint8_t held = 1 + next_random(16);
+		for (uint8_t i = 0; i < held && n < STREAM_LEN; ++i) {
+			out[n++] = (direction << 4) | speed;
+		}
+	}
+	*messages = n;
+	return n;
+}
+
+// protocol_1 as typed at a terminal, the motor keys only
+static uint16_t stream_protocol_1(uint8_t *out, uint16_t *messages) {
+	static const char keys[] = "RrslLFfhbBaoepu ";
+	uint16_t n = 0;
+	while (n < STREAM_LEN) out[n++] = keys[next_random(sizeof(keys) - 1)];
+	*messages = n;
+	return n;
+}
+
+#if WITH_PROTOCOL_FRAMED
+// one packet per update, with both drive and steer
+static uint16_t stream_framed(uint8_t *out, uint16_t *messages) {
+	uint16_t n = 0;
+	*messages = 0;
+	for (;;) {
+		int16_t drive = (int16_t) next_random(255) * (next_random(2) ? 1 : -1);
+		int16_t steer = (int16_t) next_random(255) * (next_random(2) ? 1 : -1);
+		uint8_t payload[6] = {
+			FRAMED_DRIVE, drive & 0xff, (uint16_t) drive >> 8,
+			FRAMED_STEER, steer & 0xff, (uint16_t) steer >> 8,
+		};
+		uint8_t packet[FRAME_ENCODED_MAX(sizeof(payload))];
+		uint8_t len = frame_encode(payload, sizeof(payload), packet);
+		if (n + len > STREAM_LEN) break;
+		memcpy(out + n, packet, len);
+		n += len;
+		++*messages;
+	}
+	return n;
+}
+#endif
+
+#if WITH_PROTOCOL_SETPOINT
+static uint16_t stream_setpoint(uint8_t *out, uint16_t *messages) {
+	uint16_t n = 0;
+	*messages = 0;
+	while (n + 3 <= STREAM_LEN) {
+		uint16_t drive = (next_random(255) * (next_random(2) ? 1 : -1)) & 0x1ff;
+		uint16_t steer = (next_random(255) * (next_random(2) ? 1 : -1)) & 0x1ff;
+		uint8_t b0 = SETPOINT_START | (drive >> 2);
+		uint8_t b1 = ((drive & 0x03) << 5) | (steer >> 4);
+		uint8_t b2 = (steer & 0x0f) << 3;
+		out[n++] = b0;
+		out[n++] = b1;
+		out[n++] = b2 | setpoint_check(b0, b1, b2);
+		++*messages;
+	}
+	return n;
+}
+#endif
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "s")) != -1) {
+		if (opt == 's') {
+			summary = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-s]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	printf(BENCH_UNITS);
+
+	// older trees wait on the transmitter in some commands
+	bench_transmitter(9600);
+
+	bench_bytes("compat dagu", PROTOCOL_COMPAT_DAGU, -1);
+	bench_bytes("compat dagu after 0xf0", PROTOCOL_COMPAT_DAGU, 0xf0);
+	bench_bytes("protocol_1", PROTOCOL_1, -1);
+
+	// Generated streams, not captures: the byte mix of each client,
+	// with no queries, so nothing waits on replies.
+	static uint8_t data[STREAM_LEN];
+	uint16_t messages;
+	uint16_t len;
+
+	len = stream_compat(data, &messages);
+	bench_stream("compat dagu stream", PROTOCOL_COMPAT_DAGU, data, len, messages);
+	len = stream_protocol_1(data, &messages);
+	bench_stream("protocol_1 stream", PROTOCOL_1, data, len, messages);
+#if WITH_PROTOCOL_FRAMED
+	len = stream_framed(data, &messages);
+	bench_stream("framed stream", PROTOCOL_FRAMED, data, len, messages);
+#endif
+#if WITH_PROTOCOL_SETPOINT
+	len = stream_setpoint(data, &messages);
+	bench_stream("setpoint stream", PROTOCOL_SETPOINT, data, len, messages);
+#endif
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+//
+//   Copyright 2012 Dave Bacon
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+//
+// Number formatting benchmark.
+//
+// Sends every value in range through each uart_send* formatter,
+// checks what reaches the transmit queue against sprintf(), and
+// reports the mean cost per call.  uart_write() of the same length is
+// timed too, as the part of each call that isn't formatting.
+//
+// Exits non-zero if any output differs.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "uart.h"
+
+// calls timed together, well within the transmit queue at 6 bytes each
+#define BATCH (32)
+
+struct variant {
+	const char *name;
+	uint32_t first;
+	uint32_t count;
+	uint8_t width;    // timed width, 0 if the variant has none
+	void (*send)(uint32_t v, uint8_t width);
+	int (*expect)(char *out, uint32_t v, uint8_t width);
+};
+
+static void send_int(uint32_t v, uint8_t w)   { uart_sendint((int16_t) v); }
+static void send_uint(uint32_t v, uint8_t w)  { uart_senduint(v); }
+static void send_intw(uint32_t v, uint8_t w)  { uart_sendintw((int16_t) v, w); }
+static void send_uintw(uint32_t v, uint8_t w) { uart_senduintw(v, w); }
+static void send_hex8(uint32_t v, uint8_t w)  { uart_sendhex8(v); }
+static void send_hex16(uint32_t v, uint8_t w) { uart_sendhex16(v); }
+
+static int expect_int(char *out, uint32_t v, uint8_t w) {
+	return sprintf(out, "%d", (int16_t) v);
+}
+static int expect_uint(char *out, uint32_t v, uint8_t w) {
+	return sprintf(out, "%u", (unsigned) v);
+}
+// precision, not field width, so zeros go after the sign; at least
+// one digit, as precision 0 prints nothing for 0
+static int expect_intw(char *out, uint32_t v, uint8_t w) {
+	return sprintf(out, "%.*d", w ? w : 1, (int16_t) v);
+}
+static int expect_uintw(char *out, uint32_t v, uint8_t w) {
+	return sprintf(out, "%.*u", w ? w : 1, (unsigned) v);
+}
+static int expect_hex8(char *out, uint32_t v, uint8_t w) {
+	return sprintf(out, "%02x", (unsigned) v);
+}
+static int expect_hex16(char *out, uint32_t v, uint8_t w) {
+	return sprintf(out, "%04x", (unsigned) v);
+}
+
+#define INT16 (-32768 & 0xffff), 0x10000
+#define UINT16 0, 0x10000
+
+static const struct variant variants[] = {
+	{ "uart_sendint",       INT16,     1, &send_int,    &expect_int },
+	{ "uart_senduint",      UINT16,    1, &send_uint,   &expect_uint },
+	{ "uart_sendintw, 1",   INT16,     1, &send_intw,   &expect_intw },
+	{ "uart_sendintw, 5",   INT16,     5, &send_intw,   &expect_intw },
+	{ "uart_senduintw, 1",  UINT16,    1, &send_uintw,  &expect_uintw },
+	{ "uart_senduintw, 5",  UINT16,    5, &send_uintw,  &expect_uintw },
+	{ "uart_sendhex8",      0, 0x100,  0, &send_hex8,   &expect_hex8 },
+	{ "uart_sendhex16",     UINT16,    0, &send_hex16,  &expect_hex16 },
+};
+
+#define VARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+// Checks every value, untimed, and with every width 0..5 if the
+// variant takes one.  Returns the number of wrong outputs.
+static uint32_t check(const struct variant *f) {
+	uint32_t bad = 0;
+	for (uint8_t w = 0; w <= (f->width ? 5 : 0); ++w) {
+		for (uint32_t i = 0; i < f->count; ++i) {
+			uint32_t v = (f->first + i) & 0xffff;
+			char want[16];
+			uint8_t got[16];
+			int n = (*f->expect)(want, v, w);
+
+			(*f->send)(v, w);
+			uint16_t len = bench_drain(got, sizeof(got));
+			if (len != n || memcmp(got, want, n) != 0) {
+				if (bad++ < 5) {
+					printf("%s: %u width %u gave \"%.*s\", not \"%s\"\n",
+						f->name, (unsigned) v, w, len, (const char *) got, want);
+				}
+			}
+		}
+	}
+	return bad;
+}
+
+// mean ns per call over the variant's whole range
+static double bench(const struct variant *f) {
+	uint32_t t[BENCH_REPS];
+	for (uint16_t r = 0; r < BENCH_REPS; ++r) {
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < f->count; i += BATCH) {
+			uint64_t start = bench_now();
+			for (uint32_t j = i; j < i + BATCH && j < f->count; ++j) {
+				(*f->send)(f->first + j, f->width);
+			}
+			total += bench_since(start);
+			bench_drain(0, 0);
+		}
+		t[r] = total;
+	}
+	return (double) bench_median(t, BENCH_REPS) / f->count;
+}
+
+// mean ns for a uart_write() of len bytes
+static double bench_write(uint8_t len) {
+	static const uint8_t data[6] = "-32768";
+	uint32_t t[BENCH_REPS];
+	for (uint16_t r = 0; r < BENCH_REPS; ++r) {
+		uint64_t start = bench_now();
+		for (uint8_t j = 0; j < BATCH; ++j) uart_write(data, len);
+		t[r] = bench_since(start);
+		bench_drain(0, 0);
+	}
+	return (double) bench_median(t, BENCH_REPS) / BATCH;
+}
+
+int main(int argc, char **argv) {
+	uint32_t bad = 0;
+
+	printf(BENCH_UNITS);
+	for (uint8_t i = 0; i < VARIANTS; ++i) {
+		const struct variant *f = &variants[i];
+		bad += check(f);
+		printf("%-20s %6.1f ns/call over %u values\n",
+			f->name, bench(f), (unsigned) f->count);
+	}
+	for (uint8_t len = 1; len <= 6; ++len) {
+		printf("uart_write, len %u     %6.1f ns/call\n", len, bench_write(len));
+	}
+
+	if (bad) {
+		printf("%u outputs differ from sprintf()\n", (unsigned) bad);
+		return 1;
+	}
+	printf("all outputs match sprintf()\n");
+	return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __stub_avr_eeprom_h__
+#define __stub_avr_eeprom_h__
+
+// EEMEM variables are ordinary memory; the accessors are in regs.c.
+
+#include <stdint.h>
+
+#define EEMEM
+
+uint8_t eeprom_read_byte(const uint8_t *p);
+void eeprom_write_byte(uint8_t *p, uint8_t v);
+void eeprom_update_byte(uint8_t *p, uint8_t v);
+uint16_t eeprom_read_word(const uint16_t *p);
+void eeprom_update_word(uint16_t *p, uint16_t v);
+void eeprom_read_block(void *dst, const void *src, unsigned n);
+void eeprom_update_block(const void *src, void *dst, unsigned n);
+
+#endif // __stub_avr_eeprom_h__
@@ -0,0 +1,9 @@
+#ifndef __stub_avr_interrupt_h__
+#define __stub_avr_interrupt_h__
+
+// Interrupt handlers become plain functions the benchmarks can call.
+#define ISR(v) void v(void); void v(void)
+#define cli() ((void) 0)
+#define sei() ((void) 0)
+
+#endif // __stub_avr_interrupt_h__
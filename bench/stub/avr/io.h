@@ -0,0 +1,49 @@
+#ifndef __stub_avr_io_h__
+#define __stub_avr_io_h__
+
+// Host stand-in for avr-libc's <avr/io.h>: the ATmega328 registers the
+// firmware uses, as plain variables defined in regs.c, and their bits.
+
+#include <stdint.h>
+
+#define REG8(n)  extern volatile uint8_t n;
+#define REG16(n) extern volatile uint16_t n;
+#include "regs.h"
+#undef REG8
+#undef REG16
+
+#define _BV(b) (1u << (b))
+#define bit_is_set(r, b)   ((r) & _BV(b))
+#define bit_is_clear(r, b) (!((r) & _BV(b)))
+#define loop_until_bit_is_set(r, b)   do { } while (bit_is_clear(r, b))
+#define loop_until_bit_is_clear(r, b) do { } while (bit_is_set(r, b))
+
+enum {
+	// UCSR0A, UCSR0B, UCSR0C
+	RXC0 = 7, TXC0 = 6, UDRE0 = 5, FE0 = 4, DOR0 = 3, UPE0 = 2, U2X0 = 1, MPCM0 = 0,
+	RXCIE0 = 7, TXCIE0 = 6, UDRIE0 = 5, RXEN0 = 4, TXEN0 = 3, UCSZ02 = 2,
+	UCSZ01 = 2, UCSZ00 = 1,
+
+	// MCUSR
+	PORF = 0, EXTRF = 1, BORF = 2, WDRF = 3,
+
+	// ADC
+	REFS0 = 6, ADLAR = 5, ADEN = 7, ADSC = 6, ADATE = 5, ADIF = 4, ADIE = 3,
+	ADPS2 = 2, ADPS1 = 1, ADPS0 = 0,
+
+	// timers
+	WGM00 = 0, WGM01 = 1, WGM02 = 3, CS00 = 0, CS01 = 1, CS02 = 2,
+	COM0A1 = 7, COM0A0 = 6, COM0B1 = 5, COM0B0 = 4,
+	WGM10 = 0, WGM11 = 1, WGM12 = 3, WGM13 = 4, CS10 = 0, CS11 = 1, CS12 = 2,
+	COM1A1 = 7, COM1A0 = 6, COM1B1 = 5, COM1B0 = 4,
+	WGM20 = 0, WGM21 = 1, WGM22 = 3, CS20 = 0, CS21 = 1, CS22 = 2,
+	COM2A1 = 7, COM2A0 = 6, COM2B1 = 5, COM2B0 = 4,
+	TOIE0 = 0, TOIE1 = 0, TOIE2 = 0, OCIE1A = 1, ICIE1 = 5, OCIE2A = 1, OCIE2B = 2,
+	TOV2 = 0, OCF2A = 1,
+
+	// ports
+	DD1 = 1, DD2 = 2, DD3 = 3, DD5 = 5, DD6 = 6,
+	PORTB1 = 1, PORTB2 = 2, PD4 = 4, PIND3 = 3, PIND4 = 4,
+};
+
+#endif // __stub_avr_io_h__
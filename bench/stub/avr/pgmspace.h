@@ -0,0 +1,19 @@
+#ifndef __stub_avr_pgmspace_h__
+#define __stub_avr_pgmspace_h__
+
+// Flash is ordinary memory on the host.
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(a) (*(const uint8_t *) (a))
+#define pgm_read_word(a) (*(const uint16_t *) (a))
+#define pgm_read_ptr(a)  (*(void * const *) (a))
+#define memcpy_P memcpy
+#define strlen_P strlen
+
+typedef char prog_char;
+
+#endif // __stub_avr_pgmspace_h__
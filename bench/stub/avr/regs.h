@@ -0,0 +1,10 @@
+// Every register the firmware touches, for io.h to declare and regs.c
+// to define.
+REG8(UCSR0A) REG8(UCSR0B) REG8(UCSR0C) REG8(UDR0) REG16(UBRR0) REG8(UBRR0H) REG8(UBRR0L)
+REG8(MCUSR)
+REG8(PORTB) REG8(PORTC) REG8(PORTD) REG8(DDRB) REG8(DDRC) REG8(DDRD) REG8(PINB) REG8(PINC) REG8(PIND)
+REG8(ADMUX) REG8(ADCSRA) REG8(ADCSRB) REG8(ADCH) REG8(ADCL) REG16(ADC)
+REG8(TCCR0A) REG8(TCCR0B) REG8(OCR0A) REG8(OCR0B) REG8(TIMSK0) REG8(TIFR0) REG8(TCNT0)
+REG8(TCCR1A) REG8(TCCR1B) REG8(TCCR1C) REG16(OCR1A) REG16(OCR1B) REG16(ICR1) REG16(TCNT1) REG8(TIMSK1) REG8(TIFR1)
+REG8(TCCR2A) REG8(TCCR2B) REG8(OCR2A) REG8(OCR2B) REG8(TIMSK2) REG8(TIFR2) REG8(TCNT2)
+REG8(SREG) REG8(GTCCR)
@@ -0,0 +1,9 @@
+#ifndef __stub_avr_wdt_h__
+#define __stub_avr_wdt_h__
+
+#define WDTO_8S (9)
+#define wdt_enable(t) ((void) 0)
+#define wdt_disable() ((void) 0)
+#define wdt_reset()   ((void) 0)
+
+#endif // __stub_avr_wdt_h__
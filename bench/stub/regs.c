@@ -0,0 +1,54 @@
+//
+//   Copyright 2012 Dave Bacon
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+// Registers and eeprom for the stub headers.  Motor and LED outputs
+// land in the timer and port registers here and go nowhere.
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <string.h>
+
+#define REG8(n)  volatile uint8_t n;
+#define REG16(n) volatile uint16_t n;
+#include <avr/regs.h>
+
+uint8_t eeprom_read_byte(const uint8_t *p) {
+	return *p;
+}
+
+void eeprom_write_byte(uint8_t *p, uint8_t v) {
+	*p = v;
+}
+
+void eeprom_update_byte(uint8_t *p, uint8_t v) {
+	*p = v;
+}
+
+uint16_t eeprom_read_word(const uint16_t *p) {
+	return *p;
+}
+
+void eeprom_update_word(uint16_t *p, uint16_t v) {
+	*p = v;
+}
+
+void eeprom_read_block(void *dst, const void *src, unsigned n) {
+	memcpy(dst, src, n);
+}
+
+void eeprom_update_block(const void *src, void *dst, unsigned n) {
+	memcpy(dst, src, n);
+}
@@ -0,0 +1,15 @@
+#ifndef __stub_util_crc16_h__
+#define __stub_util_crc16_h__
+
+#include <stdint.h>
+
+// as avr-libc's: polynomial 0x07, no reflection
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data) {
+	crc ^= data;
+	for (uint8_t i = 0; i < 8; ++i) {
+		crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+
+#endif // __stub_util_crc16_h__
@@ -0,0 +1,6 @@
+#ifndef __stub_util_delay_h__
+#define __stub_util_delay_h__
+
+// The firmware's delays are its own busy loops; nothing is needed here.
+
+#endif // __stub_util_delay_h__
@@ -0,0 +1,102 @@
+//
+//   Copyright 2012 Dave Bacon
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+#include "frame.h"
+
+#include <util/crc16.h>
+
+static uint8_t crc8(const uint8_t *data, uint8_t len) {
+	uint8_t crc = 0;
+	for (uint8_t i = 0; i < len; ++i) {
+		crc = _crc8_ccitt_update(crc, data[i]);
+	}
+	return crc;
+}
+
+void frame_decoder_reset(struct frame_decoder *d) {
+	d->len = 0;
+	d->remaining = 0;
+	d->zero = 0;
+	d->overflow = 0;
+}
+
+static void frame_put(struct frame_decoder *d, uint8_t ch) {
+	if (d->len < FRAME_MAX) {
+		d->buf[d->len++] = ch;
+	} else {
+		d->overflow = 1;
+	}
+}
+
+uint8_t frame_decode(struct frame_decoder *d, uint8_t ch) {
+
+	if (ch != 0) {
+		if (d->remaining == 0) {
+			// a COBS code byte starts a block of ch-1 data bytes,
+			// which is followed by a zero unless ch is 0xff or the
+			// block is the last in the packet
+			if (d->zero) frame_put(d, 0);
+			d->zero = (ch != 0xff);
+			d->remaining = ch - 1;
+		} else {
+			frame_put(d, ch);
+			d->remaining--;
+		}
+		return FRAME_NONE;
+	}
+
+	// zero ends the packet
+
+	uint8_t len = d->len;
+	uint8_t truncated = d->remaining != 0;
+	uint8_t overflow = d->overflow;
+	frame_decoder_reset(d);
+
+	if (len == 0 && !truncated) return FRAME_NONE; // idle, or back-to-back zeros
+
+	if (truncated || overflow || len == 0) return FRAME_BAD;
+	if (crc8(d->buf, len - 1) != d->buf[len - 1]) return FRAME_BAD;
+
+	d->size = len - 1;
+	return FRAME_OK;
+}
+
+uint8_t frame_encode(const uint8_t *payload, uint8_t len, uint8_t *out) {
+	uint8_t crc = crc8(payload, len);
+
+	uint8_t code_at = 0;
+	uint8_t code = 1;
+	uint8_t n = 1;
+
+	for (uint8_t i = 0; i <= len; ++i) {
+		uint8_t ch = (i < len) ? payload[i] : crc;
+		if (ch == 0) {
+			out[code_at] = code;
+			code_at = n++;
+			code = 1;
+		} else {
+			out[n++] = ch;
+			if (++code == 0xff) {
+				out[code_at] = code;
+				code_at = n++;
+				code = 1;
+			}
+		}
+	}
+	out[code_at] = code;
+	out[n++] = 0;
+	return n;
+}
@@ -0,0 +1,75 @@
+//
+//   Copyright 2012 Dave Bacon
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+#ifndef __frame_h__
+#define __frame_h__
+
+#include <inttypes.h>
+
+//
+// Packet framing for binary protocols.
+//
+// A packet is its payload followed by a CRC-8 of the payload
+// (polynomial 0x07, initial value 0, as avr-libc's
+// _crc8_ccitt_update()), COBS encoded so it contains no zero bytes,
+// and terminated by a single zero byte.  A receiver that joins
+// mid-stream or sees a corrupt byte resynchronizes at the next zero.
+//
+// The CRC catches every single-bit error in the decoded packet.  A
+// flipped COBS code byte moves the data instead, and worse corruption,
+// or random bytes that happen to end in a zero, pass up to about 1
+// time in 256.  A caller that must not mistake noise for a packet
+// should want more than one in a row; bench/frame-bench measures the
+// rates.
+//
+
+// Largest decoded packet, payload plus CRC.
+#ifndef FRAME_MAX
+#define FRAME_MAX (32)
+#endif
+
+// Room frame_encode() needs for a payload of len bytes: one COBS code
+// byte per 254 bytes, the CRC and the terminating zero.
+#define FRAME_ENCODED_MAX(len) ((len) + 2 + ((len) + 1) / 254 + 1)
+
+#define FRAME_NONE (0) // no complete packet yet
+#define FRAME_OK   (1) // a good packet is in buf[0..size-1]
+#define FRAME_BAD  (2) // a packet was dropped, bad COBS, CRC or length
+
+struct frame_decoder {
+	uint8_t buf[FRAME_MAX];
+	uint8_t len;        // payload bytes decoded so far
+	uint8_t remaining;  // bytes left in the current COBS block
+	uint8_t zero;       // a zero is owed before the next block
+	uint8_t overflow;   // packet was longer than FRAME_MAX
+	uint8_t size;       // payload length of the last good packet
+};
+
+void frame_decoder_reset(struct frame_decoder *d);
+
+/**
+ * Feed one received byte.  On FRAME_OK the payload, without its CRC,
+ * is d->buf[0..d->size-1] until the next call.
+ */
+uint8_t frame_decode(struct frame_decoder *d, uint8_t ch);
+
+/**
+ * COBS encode payload and its CRC into out, with the terminating zero.
+ * out must hold FRAME_ENCODED_MAX(len) bytes.  Returns bytes written.
+ */
+uint8_t frame_encode(const uint8_t *payload, uint8_t len, uint8_t *out);
+
+#endif // __frame_h__
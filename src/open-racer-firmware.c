@@ -22,13 +22,43 @@
 //
 
 
+// Before <util/delay.h>, which would quietly default it to 1 MHz; see
+// tick.h and uart.c, built apart, which need the same value.
+#ifndef F_CPU
+#error "F_CPU must be set, -DF_CPU=8000000UL as shipped"
+#endif
+
 #include <avr/io.h>
 #include <util/delay.h>
 #include <avr/interrupt.h>
 #include <avr/eeprom.h>
 #include <avr/wdt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <string.h>
 
 #include "uart.h"
+#include "frame.h"
+#include "tick.h"
+
+
+// Optional features, each can be left out with -DWITH_...=0.  The
+// DAGU_EXT_REPORT capability report lists only what is built in.
+#ifndef WITH_PROTOCOL_FRAMED
+#define WITH_PROTOCOL_FRAMED (1)
+#endif
+#ifndef WITH_PROTOCOL_SETPOINT
+#define WITH_PROTOCOL_SETPOINT (1)
+#endif
+#ifndef WITH_BAUD_NEGOTIATION
+#define WITH_BAUD_NEGOTIATION (1)
+#endif
+#ifndef WITH_TELEMETRY
+#define WITH_TELEMETRY (1)
+#endif
+#ifndef WITH_TRAJECTORY
+#define WITH_TRAJECTORY (1)
+#endif
 
 
 //
@@ -88,15 +118,32 @@
 //  = setup bluetooth connected signal input pin
 //  = bluetooth disconnect state detect and motor halt
 //  + info display of cause of reset
+//  + interrupt-driven serial receive into a ring buffer
+//  + interrupt-driven serial transmit queue
+//  + baud rate negotiation up to the fastest rate within tolerance
+//  * move string constants to flash section
+//  + framed binary protocol, COBS and CRC-8
+//  + 3-byte absolute setpoint protocol for both axes
+//  + millisecond tick, ping with receive/reply timestamps
+//  + periodic binary telemetry
+//  + timed setpoint queue run from the tick interrupt
+//  + dead-man command timeout with ramp-down
+//  + protocol handler cost benchmark on the host
+//  + length-prefixed extension arguments, settings from compat mode
+//  + protocol switch-back from every protocol, optional autodetect on connect
+//  + slew-rate-limited motor ramps from the tick interrupt
+//  + 9-bit drive PWM at the original carrier, 10-bit velocity API
+//  + PWM carrier per motor, picked at run time and kept in eeprom
+//  + calibrated, symmetric velocity to duty map, deadband start duty
+//  + brake, coast and brake-then-coast drive stops, reversal via a stop
+//  + steering end-stop hold at reduced duty after a settle time
 //
 // Left TODO:
 //
 //  = display selected speed grade
 //
-//  + convert serial comm from polled to interrupt, out of the mainloop
 //  + low-battery state should sleep, not continue to busy-loop poll
 //  + optimize power usage - extend battery life
-//  * move string constants to flash section
 //  * Remote control software - Android app
 //
 
@@ -248,14 +295,68 @@ static void age_once() {
 
 
 
-static void motor_drive_forward(int16_t speed) {
-	OCR1A = 0;
-	OCR1B = speed;
+// Drive PWM.
+//
+// Timer1 runs fast PWM with ICR1 as TOP, drivepwmtop, which is set
+// with the carrier (see pwm_drive_carrier()).  The default, TOP 511,
+// gives 9 bits at 15.6 kHz, twice the steps of the old 8-bit
+// phase-correct setup at the same carrier (15.7 kHz).  The bridge
+// drives the motor while a pin is low, and fast PWM puts out a
+// one-clock pulse at OCR1x = 0, so the outputs are non-inverting with
+// OCR1x = TOP - duty: stopped is then steadily high and the pulse
+// lands at full duty, where it doesn't matter.
+//
+// Drive velocities are in DRIVE_MAX (10-bit) units whatever TOP is,
+// and scaled to it at the output.  The original -255..255 velocities
+// convert with drive_fine().
+
+#define DRIVE_MAX (1023)
+#define DRIVE_OCR(duty) (drivepwmtop - (duty))
+
+static uint16_t drivepwmtop = 511; // at most DRIVE_MAX
+
+/** -255..255 velocity to DRIVE_MAX units; 255 is DRIVE_MAX exactly */
+static int16_t drive_fine(int16_t v) {
+	if (v > 255) v = 255;
+	if (v < -255) v = -255;
+	uint16_t m = (v < 0) ? -v : v;
+	m = (m << 2) | (m >> 6);
+	return (v < 0) ? -(int16_t) m : (int16_t) m;
+}
+
+/** DRIVE_MAX units back to -255..255 */
+static int16_t drive_coarse(int16_t v) {
+	return (v < 0) ? -(-v >> 2) : (v >> 2);
+}
+
+/** 0..DRIVE_MAX to a 0..drivepwmtop duty */
+static uint16_t drive_duty(uint16_t m) {
+	return ((uint32_t) m * (drivepwmtop + 1)) >> 10;
+}
+
+// Both pins high brakes, shorting the motor through the bridge; both
+// low lets it coast.  Between pulses a driving motor is braked.
+
+static void motor_drive_forward(uint16_t duty) {
+	OCR1A = DRIVE_OCR(0);
+	OCR1B = DRIVE_OCR(duty);
+	TCCR1A |= _BV(COM1A1) | _BV(COM1B1);
+}
+
+static void motor_drive_reverse(uint16_t duty) {
+	OCR1B = DRIVE_OCR(0);
+	OCR1A = DRIVE_OCR(duty);
+	TCCR1A |= _BV(COM1A1) | _BV(COM1B1);
+}
+
+static void motor_drive_brake() {
+	motor_drive_forward(0);
 }
 
-static void motor_drive_reverse(int16_t speed) {
-	OCR1B = 0;
-	OCR1A = speed;
+// Fast PWM can't hold a pin low, so the pins are taken from the timer.
+static void motor_drive_coast() {
+	PORTB &= ~(_BV(PORTB1) | _BV(PORTB2));
+	TCCR1A &= ~(_BV(COM1A1) | _BV(COM1B1));
 }
 
 static void rev_motor_drive(uint8_t repeat) {
@@ -263,79 +364,84 @@ static void rev_motor_drive(uint8_t repeat) {
 	uint8_t speed = 0;
 
 	while (++speed < 255) {
-		OCR1A = speed;
+		motor_drive_reverse(drive_duty(drive_fine(speed)));
 		delay_100us(50);
 	}
 	while (--speed > 0) {
-		OCR1A = speed;
+		motor_drive_reverse(drive_duty(drive_fine(speed)));
 		delay_100us(50);
 	}
-	OCR1A = 0;
+	motor_drive_reverse(0);
 
 	while (++speed < 255) {
-		OCR1B = speed;
+		motor_drive_forward(drive_duty(drive_fine(speed)));
 		delay_100us(50);
 	}
 	while (--speed > 0) {
-		OCR1B = speed;
+		motor_drive_forward(drive_duty(drive_fine(speed)));
 		delay_100us(50);
 	}
-	OCR1B = 0;
+	motor_drive_forward(0);
 }
 
 static void pulse_motor_drive(uint8_t speed, uint8_t repeat) {
-	OCR1A = 0x0000;
-	OCR1B = 0x0000;
+	uint16_t duty = drive_duty(drive_fine(speed));
+	motor_drive_forward(0);
 
 	for (uint8_t i = 0; i < repeat; ++ i) {
-		OCR1A = speed;
+		motor_drive_reverse(duty);
 		delay_10ms(10);
-		OCR1A = 0;
+		motor_drive_reverse(0);
 		delay_10ms(10);
-		OCR1B = speed;
+		motor_drive_forward(duty);
 		delay_10ms(10);
-		OCR1B = 0;
+		motor_drive_forward(0);
 		delay_10ms(10);
 	}
 }
 
+// Steering PWM, timer0, 8-bit.  As with the drive, the outputs are
+// non-inverting with OCR0x = 0xff - duty, so stopped is steadily high
+// in both the phase-correct and fast modes the carriers use.
+
+#define STEER_OCR(duty) (0xff - (duty))
+
 static void motor_steer_right(uint8_t value) {
-	OCR0B = 0;
-	OCR0A = value;
+	OCR0B = STEER_OCR(0);
+	OCR0A = STEER_OCR(value);
 }
 
 static void motor_steer_left(uint8_t value) {
-	OCR0A = 0;
-	OCR0B = value;
+	OCR0A = STEER_OCR(0);
+	OCR0B = STEER_OCR(value);
 }
 
 static void pulse_motor_steering(uint8_t speed, uint8_t repeat) {
 
 	// always 1 dir
-	OCR0A = 0;
-	OCR0B = 0;
+	motor_steer_right(0);
 
 	for (uint8_t i = 0; i < repeat; ++i) {
 
-		OCR0A = speed;
+		motor_steer_right(speed);
 		led1on();
 		led2off();
 		led3off();
 		delay_10ms(10);
 
-		OCR0A = 0;
+		motor_steer_right(0);
 		led1off();
 		led2on();
 		led3off();
 		delay_10ms(10);
 
-		OCR0B = speed;
+		motor_steer_left(speed);
 		led1off();
 		led2off();
 		led3on();
 		delay_10ms(10);
 
-		OCR0B = 0;
+		motor_steer_left(0);
 		led1off();
 		led2on();
 		led3off();
@@ -350,355 +456,2469 @@ static void pulse_motor_steering(uint8_t speed, uint8_t repeat) {
 }
 
 
-static int16_t velocity = 0;
+// Velocity to duty calibration.
+//
+// Each motor has a struct motor_cal, from which a table of duties per
+// direction is built whenever it changes.  Any nonzero command gets at
+// least the start duty, to get past the motor's static friction, and
+// the largest gets max, with the span between scaled by that
+// direction's gain; expo bends the curve towards cubic, for finer
+// control near the middle.  The tables hold CAL_POINTS evenly spaced
+// duties, interpolated between: four of 256 entries would not fit in
+// RAM beside the queues.
+
+#define CAL_STEPS_LOG2 (4)
+#define CAL_POINTS ((1 << CAL_STEPS_LOG2) + 1)
+#define DRIVE_CAL_SHIFT (10 - CAL_STEPS_LOG2) // DRIVE_MAX units per step, log2
+#define STEER_CAL_SHIFT (8 - CAL_STEPS_LOG2)
+
+#define CAL_UNITY (128) // gain of 1
+
+#define CAL_FORWARD (0) // and steering right
+#define CAL_REVERSE (1) // and left
+
+// CAL_* fields, as set by CONFIG_DRIVE_CAL, are the byte offsets in
+// struct motor_cal.
+#define CAL_START			(0)
+#define CAL_MAX				(1)
+#define CAL_GAIN_FORWARD	(2)
+#define CAL_GAIN_REVERSE	(3)
+#define CAL_EXPO			(4)
+#define CAL_FIELDS			(5)
+
+struct motor_cal {
+	uint8_t start; // duty for the smallest command, 255 full
+	uint8_t max; // for the largest, before gain
+	uint8_t gain[2]; // of the start to max span, CAL_FORWARD/CAL_REVERSE
+	uint8_t expo; // 0 linear to 255 cubic
+};
+
+static const struct motor_cal caldefault PROGMEM = {
+	.start = 0,
+	.max = 255,
+	.gain = { CAL_UNITY, CAL_UNITY },
+	.expo = 0,
+};
+
+#define CALMAGIC 0x5c
+
+uint8_t EEMEM eecalmagic = 0xff; // CALMAGIC once saved
+struct motor_cal EEMEM eedrivecal;
+struct motor_cal EEMEM eesteercal;
+
+static struct motor_cal drivecal;
+static struct motor_cal steercal;
+
+// [direction][point]; 0..DRIVE_MAX+1 and 0..256, the top for
+// interpolating to a full command
+static uint16_t drivecaltable[2][CAL_POINTS];
+static uint16_t steercaltable[2][CAL_POINTS];
+
+/** builds one direction's table from c, full being duty 255 */
+static void cal_build(uint16_t *t, const struct motor_cal *c, uint8_t dir, uint16_t full) {
+	int32_t span = ((int32_t) c->max - c->start) * c->gain[dir] / CAL_UNITY;
+	if (span < 0) span = 0;
+	if (span > 2 * 255) span = 2 * 255; // past full at any curve anyway
+
+	for (uint8_t k = 0; k < CAL_POINTS; ++k) {
+		// x + expo (x^3 - x), with x = k / (CAL_POINTS - 1) and 1 as 2^15
+		int32_t x = (int32_t) k << (15 - CAL_STEPS_LOG2);
+		int32_t x3 = (((x * x) >> 15) * x) >> 15;
+		int32_t curve = x + (x3 - x) * c->expo / 255;
+
+		uint32_t y = (((uint32_t) c->start << 15) + span * curve) >> 7; // 255 << 8 full
+		uint32_t d = y * full / (255UL << 8);
+		t[k] = (d > full) ? full : d;
+	}
+}
+
+/** duty for command magnitude m from table t, at most top; shift is
+ * DRIVE_CAL_SHIFT or STEER_CAL_SHIFT */
+static inline uint16_t cal_duty(const uint16_t *t, uint16_t m, uint8_t shift, uint16_t top) {
+	if (m == 0) return 0;
+	const uint16_t *p = t + (m >> shift);
+	uint16_t d = p[0] + (((p[1] - p[0]) * (m & ((1 << shift) - 1))) >> shift);
+	return (d > top) ? top : d;
+}
+
+
+static int16_t velocity = 0; // DRIVE_MAX units
 
-static void motor_drive_set_velocity(int16_t newvelocity) {
-	if (newvelocity > 255) newvelocity = 255;
-	if (newvelocity < -255) newvelocity = -255;
-	velocity = newvelocity;
-	if (velocity >= 0) {
-		motor_drive_forward(velocity & 0xff);
+// Drive stop modes.
+//
+// At zero velocity the drive brakes, coasts, or brakes for
+// drivebrakems then coasts, as set by CONFIG_DRIVE_STOP.  A change of
+// direction passes through drivereversems of that stop first, so the
+// bridge never goes straight from one diagonal to the other and the
+// motor's back EMF is spent before it is driven the other way.  The
+// tick interrupt runs the timings, see drive_stop_isr().
+
+#define DRIVE_STOP_BRAKE		(0) // as before the stop modes
+#define DRIVE_STOP_COAST		(1)
+#define DRIVE_STOP_BRAKE_COAST	(2)
+
+#define drivebrakemsdefault (250)
+#define drivereversemsdefault (20)
+
+static uint8_t drivestop = DRIVE_STOP_BRAKE;
+static uint16_t drivebrakems = drivebrakemsdefault;
+static uint16_t drivereversems = drivereversemsdefault;
+
+static int8_t drivedir = 0; // being driven: 1 forward, -1 reverse, 0 stopped
+static int8_t drivelastdir = 0; // before the stop
+static uint16_t drivestoppedms = 0xffff; // saturating
+
+static void drive_stop_output() {
+	if (drivestop == DRIVE_STOP_COAST
+			|| (drivestop == DRIVE_STOP_BRAKE_COAST && drivestoppedms >= drivebrakems)) {
+		motor_drive_coast();
 	} else {
-		motor_drive_reverse(0xff - (velocity & 0xff));
+		motor_drive_brake();
 	}
 }
 
+// Puts velocity on the bridge, or stops it for now if that is a
+// reversal still inside drivereversems.  Interrupts off.
+static void drive_output() {
+	int8_t dir = (velocity > 0) ? 1 : (velocity < 0) ? -1 : 0;
 
-static int16_t steerposition = 0;
+	if (drivedir != 0 && dir != drivedir) {
+		drivelastdir = drivedir;
+		drivedir = 0;
+		drivestoppedms = 0;
+	}
 
-static void motor_steer_set_velocity(int16_t newsteerposition) {
-	if (newsteerposition > 255) newsteerposition = 255;
-	if (newsteerposition < -255) newsteerposition = -255;
-	steerposition = newsteerposition;
-	if (steerposition >= 0) {
-		motor_steer_right(steerposition & 0xff);
-	} else {
-		motor_steer_left(0xff - (steerposition & 0xff));
+	if (dir != 0 && (dir == drivedir || dir == drivelastdir
+			|| drivestoppedms >= drivereversems)) {
+		drivedir = dir;
+		if (dir > 0) {
+			motor_drive_forward(drive_duty(cal_duty(drivecaltable[CAL_FORWARD],
+					velocity, DRIVE_CAL_SHIFT, DRIVE_MAX)));
+		} else {
+			motor_drive_reverse(drive_duty(cal_duty(drivecaltable[CAL_REVERSE],
+					-velocity, DRIVE_CAL_SHIFT, DRIVE_MAX)));
+		}
+		return;
 	}
+	drive_stop_output();
 }
 
+// Each ms from the tick interrupt: times the stop, and starts a
+// reversal waiting on it.
+static void drive_stop_isr() {
+	if (drivedir != 0) return;
 
-static uint8_t bluetooth_connected() {
-	// The original source shows it was on B0, but it
-	// now seems to be found on D4.
-	return bit_is_set(PIND, PIND4);
+	if (drivestoppedms != 0xffff) drivestoppedms++;
+	if (velocity != 0 && drivestoppedms >= drivereversems) {
+		drive_output();
+	} else if (drivestop == DRIVE_STOP_BRAKE_COAST && drivestoppedms >= drivebrakems) {
+		motor_drive_coast();
+	}
 }
 
+// The motors are set from both the main loop and the tick interrupt,
+// so the 16-bit OCR1x writes and velocity updates must not be split.
 
-static void bluetooth_setname(char *name)
-{
-	uart_send("AT+NAME");
-	uart_send(name);
+static void motor_drive_set_fine(int16_t newvelocity) {
+	if (newvelocity > DRIVE_MAX) newvelocity = DRIVE_MAX;
+	if (newvelocity < -DRIVE_MAX) newvelocity = -DRIVE_MAX;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		velocity = newvelocity;
+		drive_output();
+	}
+}
 
-	if (!uart_expect("OKsetname")) {
-		flash_led1(2, 0);
+static void drive_stop_set(uint16_t mode) {
+	if (mode > DRIVE_STOP_BRAKE_COAST) return;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		drivestop = mode;
+		drive_output();
 	}
 }
 
-typedef void (*protohandler_t)(uint8_t);
 
-static void handle_char_compat_dagu(uint8_t command);
-static void handle_char_protocol_1(uint8_t command);
+static int16_t steerposition = 0;
 
-static protohandler_t handler = &handle_char_compat_dagu;
+// Steering hold.
+//
+// The steering motor is driven against its end stops and stalls
+// there, so a command held for steersettlems drops to at most
+// steerhold duty, enough to hold against the return spring.  The
+// current saved is estimated from the duty: a stalled motor draws
+// current in proportion to it, so battery power goes as its square,
+// steerstallmw being the power at full duty.
 
-static uint8_t battlevel;
+#define steersettlemsdefault (250)
+#define steerholddefault (128) // 255 never reduces
+#define steerstallmwdefault (5000)
 
+static uint16_t steersettlems = steersettlemsdefault;
+static uint8_t steerhold = steerholddefault;
+static uint16_t steerstallmw = steerstallmwdefault;
 
-#define DAGU_DIR_0_STOP_STRAIGHT	(0x0)
-#define DAGU_DIR_1_FORW_STRAIGHT	(0x1)
-#define DAGU_DIR_2_BACK_STRAIGHT	(0x2)
-#define DAGU_DIR_3_STOP_LEFT		(0x3)
-#define DAGU_DIR_4_STOP_RIGHT		(0x4)
-#define DAGU_DIR_5_FORW_LEFT		(0x5)
-#define DAGU_DIR_6_FORW_RIGHT		(0x6)
-#define DAGU_DIR_7_BACK_LEFT		(0x7)
-#define DAGU_DIR_8_BACK_RIGHT		(0x8)
-#define DAGU_DIR_F_EXT_ESCAPE		(0xf)
+static uint16_t steerms = 0; // since the command changed, up to steersettlems
+static uint8_t steerduty = 0; // commanded, before any hold
 
-// The value for DAGU_EXT_REPORT is chosen to be the same as
-// DAGU_DIR_0_STOP_STRAIGHT control byte so that it is harmless if
-// sent to a car running the original firmware not supporting the
-// extension escape byte.  No other escape+extension sequence
-// should be attempted unless a response from the DAGU_EXT_REPORT
-// reports capability to do so.
-#define DAGU_EXT_REPORT				(0x00)
+#define STEER_FULL_SQ (255U * 255U)
 
-#define DAGU_EXT_PROTOCOL_SWITCH_1	(0x01)
-#define DAGU_EXT_PROTOCOL_Q_BATT	(0x02)
+static uint32_t steerheldms = 0; // at steerhold, saturating
+static uint16_t steersavedsq = 0; // full duty^2 less hold duty^2 per ms, below STEER_FULL_SQ
+static uint32_t steersavedms = 0; // steersavedsq carried as ms at full duty, saturating
 
+// Interrupts off.
+static void steer_output() {
+	uint8_t duty = steerduty;
+	if (steerms >= steersettlems && duty > steerhold) duty = steerhold;
 
-static uint8_t escaped = 0;
+	if (steerposition >= 0) {
+		motor_steer_right(duty);
+	} else {
+		motor_steer_left(duty);
+	}
+}
 
-static void handle_char_compat_dagu(uint8_t command) {
-	if (!escaped) {
-		uint8_t speed = 105 + (command & 0x0f) * 1;
-		uint8_t direction = (command & 0xf0) >> 4;
-
-		switch (direction) {
-		case DAGU_DIR_0_STOP_STRAIGHT:
-			motor_steer_set_velocity(0);
-			motor_drive_set_velocity(0);
-			break;
-		case DAGU_DIR_1_FORW_STRAIGHT:
-			motor_steer_set_velocity(0);
-			motor_drive_set_velocity(speed);
-			break;
-		case DAGU_DIR_2_BACK_STRAIGHT:
-			motor_steer_set_velocity(0);
-			motor_drive_set_velocity(-speed);
-			break;
-		case DAGU_DIR_3_STOP_LEFT:
-			motor_steer_set_velocity(-255);
-			motor_drive_set_velocity(0);
-			break;
-		case DAGU_DIR_4_STOP_RIGHT:
-			motor_steer_set_velocity(255);
-			motor_drive_set_velocity(0);
-			break;
-		case DAGU_DIR_5_FORW_LEFT:
-			motor_steer_set_velocity(-255);
-			motor_drive_set_velocity(speed);
-			break;
-		case DAGU_DIR_6_FORW_RIGHT:
-			motor_steer_set_velocity(255);
-			motor_drive_set_velocity(speed);
-			break;
-		case DAGU_DIR_7_BACK_LEFT:
-			motor_steer_set_velocity(-255);
-			motor_drive_set_velocity(-speed);
-			break;
-		case DAGU_DIR_8_BACK_RIGHT:
-			motor_steer_set_velocity(255);
-			motor_drive_set_velocity(-speed);
-			break;
+static void motor_steer_set_velocity(int16_t newsteerposition) {
+	if (newsteerposition > 255) newsteerposition = 255;
+	if (newsteerposition < -255) newsteerposition = -255;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (newsteerposition != steerposition) steerms = 0;
+		steerposition = newsteerposition;
+		if (steerposition >= 0) {
+			steerduty = cal_duty(steercaltable[CAL_FORWARD],
+					steerposition, STEER_CAL_SHIFT, 0xff);
+		} else {
+			steerduty = cal_duty(steercaltable[CAL_REVERSE],
+					-steerposition, STEER_CAL_SHIFT, 0xff);
+		}
+		steer_output();
+	}
+}
 
-		case DAGU_DIR_F_EXT_ESCAPE:
-			escaped = 1;
-			break;
+// Each ms from the tick interrupt: times the settle, and counts the
+// hold.
+static void steer_hold_isr() {
+	if (steerms < steersettlems) {
+		if (++steerms == steersettlems) steer_output();
+	} else if (steerduty > steerhold) {
+		if (steerheldms != 0xffffffff) steerheldms++;
+		// each step is below STEER_FULL_SQ, so at most one carry
+		uint16_t sq = (uint16_t) steerduty * steerduty - (uint16_t) steerhold * steerhold;
+		if (sq >= STEER_FULL_SQ - steersavedsq) {
+			steersavedsq -= STEER_FULL_SQ - sq;
+			if (steersavedms != 0xffffffff) steersavedms++;
+		} else {
+			steersavedsq += sq;
 		}
-	} else {
-		escaped = 0;
-		switch (command) {
+	}
+}
 
-		case DAGU_EXT_REPORT:
-			uart_send("ver=1\ncap=\n");
-			break;
+static void steer_hold_set(uint16_t settlems, uint8_t hold) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		steersettlems = settlems;
+		steerhold = hold;
+		steer_output();
+	}
+}
 
-		case DAGU_EXT_PROTOCOL_SWITCH_1:
-			handler = &handle_char_protocol_1;
-			break;
+// Rebuilds the drive's tables from drivecal, and applies them to the
+// velocity now.  Built aside, as it takes a few ms.
+static void cal_drive_apply() {
+	uint16_t t[2][CAL_POINTS];
+	cal_build(t[CAL_FORWARD], &drivecal, CAL_FORWARD, DRIVE_MAX + 1);
+	cal_build(t[CAL_REVERSE], &drivecal, CAL_REVERSE, DRIVE_MAX + 1);
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memcpy(drivecaltable, t, sizeof(t));
+		motor_drive_set_fine(velocity);
+	}
+}
 
-		case DAGU_EXT_PROTOCOL_Q_BATT:
-			uart_send("batt="); uart_sendint(battlevel); uart_sendch('\n');
-			break;
-		}
+// As cal_drive_apply(), for steering.
+static void cal_steer_apply() {
+	uint16_t t[2][CAL_POINTS];
+	cal_build(t[CAL_FORWARD], &steercal, CAL_FORWARD, 256);
+	cal_build(t[CAL_REVERSE], &steercal, CAL_REVERSE, 256);
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memcpy(steercaltable, t, sizeof(t));
+		motor_steer_set_velocity(steerposition);
 	}
 }
 
-static void handle_char_protocol_1(uint8_t command) {
+static void cal_save() {
+	eeprom_update_block(&drivecal, &eedrivecal, sizeof(drivecal));
+	eeprom_update_block(&steercal, &eesteercal, sizeof(steercal));
+	eeprom_update_byte(&eecalmagic, CALMAGIC);
+}
 
-	switch (command) {
-	case 'R': motor_steer_set_velocity( 255); break;
-	case 'r': motor_steer_set_velocity( 127); break;
-	case 's': motor_steer_set_velocity(   0); break;
-	case 'l': motor_steer_set_velocity(-127); break;
-	case 'L': motor_steer_set_velocity(-255); break;
+// The calibration saved in eeprom, or the defaults if none is.
+static void cal_load() {
+	if (eeprom_read_byte(&eecalmagic) == CALMAGIC) {
+		eeprom_read_block(&drivecal, &eedrivecal, sizeof(drivecal));
+		eeprom_read_block(&steercal, &eesteercal, sizeof(steercal));
+	} else {
+		memcpy_P(&drivecal, &caldefault, sizeof(drivecal));
+		memcpy_P(&steercal, &caldefault, sizeof(steercal));
+	}
+	cal_drive_apply();
+	cal_steer_apply();
+}
 
-	case 'F': motor_drive_set_velocity( 255); break;
-	case 'f': motor_drive_set_velocity( 127); break;
-	case 'h': motor_drive_set_velocity(   0); break;
-	case 'b': motor_drive_set_velocity(-127); break;
-	case 'B': motor_drive_set_velocity(-255); break;
+static void cal_defaults_save() {
+	memcpy_P(&drivecal, &caldefault, sizeof(drivecal));
+	memcpy_P(&steercal, &caldefault, sizeof(steercal));
+	cal_drive_apply();
+	cal_steer_apply();
+	cal_save();
+}
 
-//	case 'u': motor_drive_set_velocity(velocity + 5); break;
-//	case 'd': motor_drive_set_velocity(velocity - 5); break;
-//	case '>': motor_steer_set_velocity(steerposition + 5); break;
-//	case '<': motor_steer_set_velocity(steerposition - 5); break;
+/** sets a CAL_* field of c, clamped to a byte; 0 if there is no such field */
+static uint8_t cal_field(struct motor_cal *c, uint8_t field, int16_t value) {
+	if (field >= CAL_FIELDS) return 0;
+	((uint8_t *) c)[field] = (value < 0) ? 0 : (value > 0xff) ? 0xff : value;
+	return 1;
+}
 
-	// sorry, dvorak for now.
-	case 'a': motor_steer_set_velocity(-255); break;
-	case 'o': motor_steer_set_velocity(0); break;
-	case 'e': motor_steer_set_velocity(255); break;
+static void cal_drive_set_save(uint8_t field, int16_t value) {
+	if (!cal_field(&drivecal, field, value)) return;
+	cal_drive_apply();
+	cal_save();
+}
 
-	case 'p': motor_drive_set_velocity(velocity + 5); break;
-	case 'u': motor_drive_set_velocity(velocity - 5); break;
+static void cal_steer_set_save(uint8_t field, int16_t value) {
+	if (!cal_field(&steercal, field, value)) return;
+	cal_steer_apply();
+	cal_save();
+}
 
-	case ' ':
-		motor_drive_set_velocity(0);
-		motor_steer_set_velocity(0);
-		break;
 
-	case 'A':
-		check_magic_and_show_age();
-		age_once();
-		check_magic_and_show_age();
-		break;
+// PWM carriers.
+//
+// Each motor's carrier is picked at run time from a table, trading
+// switching losses (lower carriers) against current ripple and whine
+// (higher; from 20 kHz up it can't be heard).  The choice is kept in
+// eeprom.  The drive carrier sets TOP and prescaler on timer1, so the
+// drive has fewer steps at 20 and 31 kHz; steering stays 8-bit, with
+// timer0's mode and prescaler picked.
+
+struct drive_carrier {
+	uint16_t top;
+	uint8_t cs; // timer1 clock select
+	uint16_t hz;
+};
+
+struct steer_carrier {
+	uint8_t wgm; // timer0 mode, TCCR0A bits
+	uint8_t cs; // timer0 clock select
+	uint16_t hz;
+};
+
+#define DRIVE_CARRIER(top, prescale, cs) \
+	{ (top), (cs), F_CPU / (prescale) / ((top) + 1) }
+#define STEER_CARRIER_PHASE(prescale, cs) \
+	{ _BV(WGM00), (cs), F_CPU / (prescale) / 510 }
+#define STEER_CARRIER_FAST(prescale, cs) \
+	{ _BV(WGM01) | _BV(WGM00), (cs), F_CPU / (prescale) / 256 }
+
+// (at 8 MHz)
+static const struct drive_carrier drive_carriers[] PROGMEM = {
+	DRIVE_CARRIER( 255, 1, _BV(CS10)), // 31.3 kHz, 8 bits
+	DRIVE_CARRIER( 399, 1, _BV(CS10)), // 20 kHz
+	DRIVE_CARRIER( 511, 1, _BV(CS10)), // 15.6 kHz, 9 bits
+	DRIVE_CARRIER(1023, 1, _BV(CS10)), // 7.8 kHz, 10 bits
+	DRIVE_CARRIER(1023, 8, _BV(CS11)), // 976 Hz, 10 bits
+};
+
+static const struct steer_carrier steer_carriers[] PROGMEM = {
+	STEER_CARRIER_FAST(1, _BV(CS00)), // 31.3 kHz
+	STEER_CARRIER_PHASE(1, _BV(CS00)), // 15.7 kHz
+	STEER_CARRIER_FAST(8, _BV(CS01)), // 3.9 kHz
+	STEER_CARRIER_PHASE(8, _BV(CS01)), // 1.96 kHz
+	STEER_CARRIER_PHASE(64, _BV(CS01) | _BV(CS00)), // 245 Hz
+};
+
+#define DRIVE_CARRIER_COUNT (sizeof(drive_carriers) / sizeof(drive_carriers[0]))
+#define STEER_CARRIER_COUNT (sizeof(steer_carriers) / sizeof(steer_carriers[0]))
+
+#define drivecarrierdefault (2) // the original carriers
+#define steercarrierdefault (1)
+
+uint8_t EEMEM eedrivecarrier = drivecarrierdefault;
+uint8_t EEMEM eesteercarrier = steercarrierdefault;
+
+static uint8_t drivecarrier = drivecarrierdefault;
+static uint8_t steercarrier = steercarrierdefault;
+
+// Switches timer1 to drive carrier i, keeping the drive's velocity.
+// Returns 0 if there is no such carrier.
+static uint8_t pwm_drive_carrier(uint16_t i) {
+	if (i >= DRIVE_CARRIER_COUNT) return 0;
+
+	const struct drive_carrier *c = &drive_carriers[i];
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		// stopped, so the counter can't be left above the new TOP
+		TCCR1B &= ~(_BV(CS12) | _BV(CS11) | _BV(CS10));
+		TCNT1 = 0;
+		drivepwmtop = pgm_read_word(&c->top);
+		ICR1 = drivepwmtop;
+		motor_drive_set_fine(velocity);
+		TCCR1B |= pgm_read_byte(&c->cs);
+	}
+	drivecarrier = i;
+	return 1;
+}
 
-	case '?':
-		uart_send("steering: RrslL\ngas: FfhbB\n");
-		uart_send("batt="); uart_sendint(ADCH); uart_sendch('\n');
-		break;
+// As pwm_drive_carrier(), for steering on timer0.
+static uint8_t pwm_steer_carrier(uint16_t i) {
+	if (i >= STEER_CARRIER_COUNT) return 0;
 
-	default: uart_send("?\n"); break;
+	const struct steer_carrier *c = &steer_carriers[i];
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		TCCR0B &= ~(_BV(CS02) | _BV(CS01) | _BV(CS00));
+		TCNT0 = 0;
+		TCCR0A = (TCCR0A & ~(_BV(WGM01) | _BV(WGM00))) | pgm_read_byte(&c->wgm);
+		TCCR0B |= pgm_read_byte(&c->cs);
 	}
+	steercarrier = i;
+	return 1;
 }
 
-static uint8_t battlevel = 11;
+// The carriers saved in eeprom, or the defaults if none are.
+static void pwm_carriers_load() {
+	if (!pwm_drive_carrier(eeprom_read_byte(&eedrivecarrier))) {
+		pwm_drive_carrier(drivecarrierdefault);
+	}
+	if (!pwm_steer_carrier(eeprom_read_byte(&eesteercarrier))) {
+		pwm_steer_carrier(steercarrierdefault);
+	}
+}
 
-static void batt_sample() {
-	uint8_t battsample = ADCH;
+static void pwm_drive_carrier_save(uint16_t i) {
+	if (pwm_drive_carrier(i)) eeprom_update_byte(&eedrivecarrier, i);
+}
 
-	// need to scale 142+0..142+48 -> 0..255, so *5
-	battsample -= 142;
-	if (battsample < 0) battsample = 0;
-	battsample *= 5;
-	if (battsample > 255) battsample = 255;
+static void pwm_steer_carrier_save(uint16_t i) {
+	if (pwm_steer_carrier(i)) eeprom_update_byte(&eesteercarrier, i);
+}
 
-	battlevel = battsample;
+static uint16_t pwm_drive_hz() {
+	return pgm_read_word(&drive_carriers[drivecarrier].hz);
 }
 
-static uint8_t batt_low_consistently(uint8_t threshold) {
-	uint8_t warn = 0;
-	for (uint8_t i = 0; i < 20; ++i) {
+static uint16_t pwm_steer_hz() {
+	return pgm_read_word(&steer_carriers[steercarrier].hz);
+}
 
-		delay_100us(10);
-		batt_sample();
+/** the drive velocity now, in DRIVE_MAX units, safe against the tick
+ * interrupt changing it */
+static int16_t motor_drive_velocity() {
+	int16_t v;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		v = velocity;
+	}
+	return v;
+}
 
-		if (battlevel < threshold) {
-			warn++;
-		}
+/** as motor_drive_velocity(), for steering */
+static int16_t motor_steer_position() {
+	int16_t v;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		v = steerposition;
 	}
+	return v;
+}
 
-	return warn > 17;
+
+// Slew-rate limits.
+//
+// Setpoints from the host, the timed setpoint queue and the dead-man
+// ramp set a target per axis (motor_drive_command()), and the tick
+// interrupt moves the motor toward it by at most the axis' rate each
+// ms.  So a jump from full reverse to full forward can't slam the
+// motor, spike the current and sag the battery, and nothing waits on
+// a ramp.  Rates are in 1/256 steps of the axis' units per ms; for
+// steering 0x100 takes 255 ms from stop to full.  The drive's units
+// are DRIVE_MAX, finer by DRIVE_PER_STEP, and CONFIG_DRIVE_SLEW is
+// scaled to match.  0 is no limit.  motors_halt() is not ramped.
+
+#define DRIVE_PER_STEP (4) // DRIVE_MAX units per -255..255 step
+
+#define driveslewdefault (0x200 * DRIVE_PER_STEP)
+#define steerslewdefault (0)
+
+struct slew {
+	volatile int16_t target;
+	volatile uint16_t rate;
+	uint8_t frac; // fraction of a step carried to the next ms
+};
+
+static struct slew driveslew = { 0, driveslewdefault, 0 };
+static struct slew steerslew = { 0, steerslewdefault, 0 };
+
+static int16_t slew_clamp(int16_t v, int16_t max) {
+	if (v > max) return max;
+	if (v < -max) return -max;
+	return v;
 }
 
+/** set the drive target, in DRIVE_MAX units */
+static void motor_drive_command_fine(int16_t newvelocity) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		driveslew.target = slew_clamp(newvelocity, DRIVE_MAX);
+		if (!driveslew.rate) motor_drive_set_fine(driveslew.target);
+	}
+}
 
-#define battlowthreshold (10)
+/** set the drive target, -255..255 */
+static void motor_drive_command(int16_t newvelocity) {
+	motor_drive_command_fine(drive_fine(newvelocity));
+}
 
-//// breathing blue led support
-//uint8_t breathelevel = 0;
-//uint8_t breathedirection = 1;
+static void motor_steer_command(int16_t newsteerposition) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		steerslew.target = slew_clamp(newsteerposition, 255);
+		if (!steerslew.rate) motor_steer_set_velocity(steerslew.target);
+	}
+}
 
-#define voltagedisplaytoggleperiodlength  (200)
-static uint8_t voltagedisplaytogglecountdown = 10;
-static uint8_t voltagedisplaytogglestate = 0;
+/** the drive target in DRIVE_MAX units, which the motor may still be
+ * ramping to */
+static int16_t motor_drive_target() {
+	int16_t v;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		v = driveslew.target;
+	}
+	return v;
+}
 
-#define battwarntoggleperiodlength (20)
-static uint8_t battwarntogglecountdown = 0;
-static uint8_t battwarntogglestate = 0;
-// assume at least more than warning-threshold until 1st sample
+static void slew_set_rate(struct slew *s, uint16_t rate) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		s->rate = rate;
+		s->frac = 0;
+	}
+}
 
-#define mainloopdelay (40)
+// from the tick interrupt; the value one ms further toward the target
+static int16_t slew_step(struct slew *s, int16_t actual) {
+	int16_t target = s->target;
+	if (actual == target || !s->rate) {
+		s->frac = 0;
+		return target;
+	}
 
+	uint16_t f = s->frac + (s->rate & 0xff);
+	uint16_t step = (s->rate >> 8) + (f >> 8);
+	s->frac = f & 0xff;
 
-int main(void) {
+	if (target > actual) {
+		return (step >= (uint16_t) (target - actual)) ? target : actual + step;
+	} else {
+		return (step >= (uint16_t) (actual - target)) ? target : actual - step;
+	}
+}
 
-	uart_init(9600);
+// A reversal ramps from 0 once its drivereversems stop is over, so the
+// step toward the new direction is held at 0 until then.
+static int16_t slew_reversal_hold(int16_t v) {
+	int8_t dir = (v > 0) ? 1 : (v < 0) ? -1 : 0;
+	if (dir == 0) return v;
+	if (drivedir != 0) return (dir == drivedir) ? v : 0;
+	if (drivelastdir != 0 && dir != drivelastdir && drivestoppedms < drivereversems) return 0;
+	return v;
+}
 
-	// ------------------------------------------------------------------------------
+// from the tick interrupt
+static void slew_isr() {
+	int16_t v = slew_reversal_hold(slew_step(&driveslew, velocity));
+	if (v != velocity) motor_drive_set_fine(v);
 
-	//
-	// Before main()
-	//   * SREG is set to 0x00, and
-	//   * stack-pointer SPH & SPL is assigned
-	// 6 instructions plus jump to main
-	//
+	v = slew_step(&steerslew, steerposition);
+	if (v != steerposition) motor_steer_set_velocity(v);
+}
 
-	// ------------------------------------------------------------------------------
+#if WITH_TRAJECTORY
 
-	cli();
+// Timed setpoint queue.
+//
+// The host can load a manoeuvre ahead of time as (delay, drive, steer)
+// entries.  The tick interrupt applies the head entry delay ms after
+// the one before it (or after it reached the head of an idle queue),
+// so the timing doesn't suffer from radio jitter.  Any setpoint from
+// the host, and any safety stop, clears the queue.
+
+#define TRAJECTORY_SIZE (16) // power of two
+#define TRAJECTORY_MASK (TRAJECTORY_SIZE - 1)
+
+struct trajectory_entry {
+	uint16_t delay; // ms
+	int16_t drive;
+	int16_t steer;
+};
+
+static struct trajectory_entry trajectory[TRAJECTORY_SIZE];
+static volatile uint8_t trajectoryhead = 0; // written by main only
+static volatile uint8_t trajectorytail = 0; // written by the ISR, or cleared atomically
+static volatile uint8_t trajectoryloaded = 0;
+static volatile uint16_t trajectorycountdown = 0;
+static uint16_t trajectoryoverflows = 0;
+
+static uint8_t trajectory_depth() {
+	return (trajectoryhead - trajectorytail) & TRAJECTORY_MASK;
+}
 
-	// sets outputs to high or enables internal pull-ups.
-	PORTB = 0xff;
-	PORTC = 0xff;
-	PORTD = 0xff;
+/** room for more entries; one slot is kept free */
+static uint8_t trajectory_free() {
+	return TRAJECTORY_MASK - trajectory_depth();
+}
 
-	// sets pins as inputs initially
-	DDRB = 0;
-	DDRC = 0;
-	DDRD = 0;
+static void trajectory_append(uint16_t delay, int16_t drive, int16_t steer) {
+	if (!trajectory_free()) {
+		if (trajectoryoverflows != 0xffff) trajectoryoverflows++;
+		return;
+	}
 
-	// ------------------------------------------------------------------------------
+	uint8_t head = trajectoryhead;
+	trajectory[head].delay = delay;
+	trajectory[head].drive = drive;
+	trajectory[head].steer = steer;
 
-	// ADC channel monitoring battery charge
+	// the entry is complete before the ISR can see it
+	__asm__ volatile("" ::: "memory");
+	trajectoryhead = (head + 1) & TRAJECTORY_MASK;
+}
 
-	ADMUX = 0;
-	ADMUX |= _BV(REFS0);
-	ADMUX |= _BV(ADLAR);
+static void trajectory_clear() {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		trajectorytail = trajectoryhead;
+		trajectoryloaded = 0;
+	}
+}
 
-	ADCSRA = 0;
-	ADCSRA |= _BV(ADPS1) | _BV(ADPS0); // prescale /8
-	ADCSRA |= _BV(ADATE);
-	ADCSRB = 0; // leave in free-running mode
-	ADCSRA |= _BV(ADEN); // enable ADC
-	ADCSRA |= _BV(ADSC); // start 1st conversion, triggering free-running mode
+// from the tick interrupt
+static void trajectory_isr() {
+	uint8_t tail = trajectorytail;
+	if (tail == trajectoryhead) return;
 
-	// ------------------------------------------------------------------------------
+	if (!trajectoryloaded) {
+		trajectorycountdown = trajectory[tail].delay;
+		trajectoryloaded = 1;
+	}
 
-	//  PWMs on steering motor
+	if (trajectorycountdown && --trajectorycountdown) return;
 
-	// phase-correct 8-bit PWM (0xf1)
-	TCCR0A = _BV(WGM00) | _BV(COM0A1) | _BV(COM0A0) | _BV(COM0B1) | _BV(COM0B0);
-	TCCR0B = 0; // no clock yet // must not clobber and set WGM02
-	OCR0A = 0;
-	OCR0B = 0;
-	TIMSK0 = 0; // no interrupts
-	TIFR0 = 0xff; // clears match & overflow interrupt flags
-	DDRD |= _BV(DD5); // (PCINT21/OC0B/T1) PD5
-	DDRD |= _BV(DD6); // (PCINT22/OC0A/AIN0) PD6
-	TCCR0B |= _BV(CS00); // clock on, no scaling
+	motor_steer_command(trajectory[tail].steer);
+	motor_drive_command(trajectory[tail].drive);
 
+	trajectorytail = (tail + 1) & TRAJECTORY_MASK;
+	trajectoryloaded = 0;
+}
 
-	// PWMs on drive motor
+#else
 
-	// phase-correct 8-bit PWM (0xf1)
-	TCCR1A = _BV(WGM10) | _BV(COM1A1) | _BV(COM1A0) | _BV(COM1B1) | _BV(COM1B0);
-	TCCR1B = 0; // no clock yet // must not clobber other pins by setting
-	OCR1A = 0;
-	OCR1B = 0;
-	TIMSK1 = 0; // no interrupts
-	TIFR1 = 0xff; // clears match & overflow interrupt flags
-	DDRB |= _BV(DD1); // PB1 (OC1A/PCINT1)
-	DDRB |= _BV(DD2); // PB2 (SS/OC1B/PCINT2)
-	TCCR1B |= _BV(CS10); // clock on, no scaling
+#define trajectory_clear()
+#define trajectory_isr()
 
+#endif // WITH_TRAJECTORY
 
-	// PWM for 'breathing' blue led
 
-	TCCR2A = _BV(WGM20) | _BV(COM2B1) | _BV(COM2B0);
-	TCCR2B = 0; // no clock yet // must not clobber and set other bits (WGM*)
-	OCR2A = 0x00ff;
-	OCR2B = 0x00ff;
-	TIMSK2 = 0x00; // no interrupts
-	TIFR2 = 0xff; // clears match & overflow interrupt flags
-	DDRD |= _BV(DD3);
-	//DDRD |= _BV(DD?); // OC2B not used
-	TCCR2B = _BV(CS20); // clock on, no scaling
+// Dead-man timeout.
+//
+// If deadmantimeout ms pass without a setpoint from the host (and with
+// no timed setpoint queue running), the host or link is assumed hung:
+// both motors are ramped down to zero by deadmanrampstep per ms,
+// rather than cut, and deadmantimeouts is counted.  The next setpoint
+// takes control again.  0 turns it off.  The setting belongs to no
+// protocol, so it is kept across protocol switches.
+
+#define deadmanrampstep (1)
+
+static volatile uint16_t deadmantimeout = 0; // ms, 0 off
+static volatile uint16_t deadmanlast = 0;
+static volatile uint8_t deadmanexpired = 0;
+static uint16_t deadmantimeouts = 0;
+
+static void deadman_feed() {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		deadmanlast = tick_now();
+		deadmanexpired = 0;
+	}
+}
 
-	// ------------------------------------------------------------------------------
+static void deadman_set_timeout(uint16_t ms) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		deadmantimeout = ms;
+		deadmanlast = tick_now();
+		deadmanexpired = 0;
+	}
+}
 
-	DDRC |= _BV(led1_pin);
-	DDRC |= _BV(led2_pin);
-	DDRC |= _BV(led3_pin);
-	DDRC |= _BV(led4_pin);
-	DDRD |= _BV(led5_pin);
+static int16_t deadman_ramp(int16_t v, int16_t step) {
+	if (v > step) return v - step;
+	if (v < -step) return v + step;
+	return 0;
+}
 
+// from the tick interrupt
+static void deadman_isr() {
+	if (!deadmantimeout) return;
 
-	led1off();
-	led2off();
-	led3off();
-	led4off();
-	led5off();
+#if WITH_TRAJECTORY
+	if (trajectorytail != trajectoryhead) {
+		deadmanlast = tick_now();
+		return;
+	}
+#endif
 
-	// ------------------------------------------------------------------------------
+	if (!deadmanexpired) {
+		if ((uint16_t) (tick_now() - deadmanlast) < deadmantimeout) return;
+		deadmanexpired = 1;
+		if (deadmantimeouts != 0xffff) deadmantimeouts++;
+	}
 
-	// Can only do this on board power-cycle, not just any cpu reset.
-	// If tried after only cpu reset, the bluetooth module isn't in command mode,
-	// and awaiting a response would hang the show.
-	if (0) bluetooth_setname("OpenRacer");
+	if (driveslew.target) motor_drive_command_fine(deadman_ramp(driveslew.target, deadmanrampstep * DRIVE_PER_STEP));
+	if (steerslew.target) motor_steer_command(deadman_ramp(steerslew.target, deadmanrampstep));
+}
 
-	// ------------------------------------------------------------------------------
+
+// Everything run from the tick interrupt, every millisecond.
+static void control_isr() {
+	trajectory_isr();
+	deadman_isr();
+	drive_stop_isr(); // before any new stop, so that counts from the next ms
+	steer_hold_isr(); // and before a new command, likewise
+	slew_isr();
+}
+
+// Stop both motors, and anything that would start them again.
+static void motors_halt() {
+	trajectory_clear();
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		driveslew.target = 0;
+		steerslew.target = 0;
+		motor_drive_set_fine(0);
+		motor_steer_set_velocity(0);
+	}
+}
+
+
+// Latest-wins setpoint mailbox.
+//
+// Protocol handlers post absolute setpoints here rather than to the
+// motors.  A newer setpoint for an axis replaces one not yet applied,
+// and mailbox_apply() sets the motors once per main loop pass, after
+// all received input has been handled.  So a burst of queued commands
+// costs one motor update and the car obeys only the newest.  Posting a
+// setpoint takes the motors back from the timed setpoint queue, and
+// counts as input for the dead-man timeout.
+
+#define MAILBOX_DRIVE	_BV(0)
+#define MAILBOX_STEER	_BV(1)
+
+static uint8_t mailboxpending = 0;
+static int16_t mailboxdrive; // DRIVE_MAX units
+static int16_t mailboxsteer;
+
+// setpoints replaced before they were applied; saturates at 0xffff
+static uint16_t mailboxcoalesced = 0;
+
+/** post a drive velocity in DRIVE_MAX units */
+static void mailbox_drive_fine(int16_t newvelocity) {
+	trajectory_clear();
+	deadman_feed();
+	if ((mailboxpending & MAILBOX_DRIVE) && mailboxcoalesced != 0xffff) mailboxcoalesced++;
+	mailboxdrive = newvelocity;
+	mailboxpending |= MAILBOX_DRIVE;
+}
+
+/** post a drive velocity, -255..255 */
+static void mailbox_drive(int16_t newvelocity) {
+	mailbox_drive_fine(drive_fine(newvelocity));
+}
+
+static void mailbox_steer(int16_t newsteerposition) {
+	trajectory_clear();
+	deadman_feed();
+	if ((mailboxpending & MAILBOX_STEER) && mailboxcoalesced != 0xffff) mailboxcoalesced++;
+	mailboxsteer = newsteerposition;
+	mailboxpending |= MAILBOX_STEER;
+}
+
+/** the drive velocity once the mailbox is applied, -255..255, for
+ * relative commands */
+static int16_t mailbox_drive_target() {
+	return drive_coarse((mailboxpending & MAILBOX_DRIVE) ? mailboxdrive : motor_drive_target());
+}
+
+static void mailbox_apply() {
+	if (mailboxpending & MAILBOX_STEER) motor_steer_command(mailboxsteer);
+	if (mailboxpending & MAILBOX_DRIVE) motor_drive_command_fine(mailboxdrive);
+	mailboxpending = 0;
+}
+
+
+static uint8_t bluetooth_connected() {
+	// The original source shows it was on B0, but it
+	// now seems to be found on D4.
+	return bit_is_set(PIND, PIND4);
+}
+
+
+// name is in flash, e.g. PSTR("OpenRacer")
+static void bluetooth_setname(const char *name)
+{
+	uart_send_P(PSTR("AT+NAME"));
+	uart_send_P(name);
+
+	if (!uart_expect_P(PSTR("OKsetname"))) {
+		flash_led1(2, 0);
+	}
+}
+
+typedef void (*protohandler_t)(uint8_t);
+
+static void handle_char_compat_dagu(uint8_t command);
+static void handle_char_protocol_1(uint8_t command);
+#if WITH_PROTOCOL_FRAMED
+static void handle_char_framed(uint8_t command);
+#endif
+#if WITH_PROTOCOL_SETPOINT
+static void handle_char_setpoint(uint8_t command);
+#endif
+static void handle_char_detect(uint8_t command);
+
+static protohandler_t handler = &handle_char_compat_dagu;
+
+// Most received bytes handled in one main loop pass, so a flood of
+// input can't starve the disconnect and battery checks.
+#define commandbudget (16)
+
+// Main loop passes that stopped at commandbudget with input still
+// waiting; saturates at 0xffff.
+static uint16_t commandbudgethits = 0;
+
+static uint8_t battlevel;
+static uint8_t battlow = 0; // motors held stopped for low battery
+
+// main loop pass time in ticks (ms), last and largest since reported
+static uint8_t looptime = 0;
+static uint8_t looptimemax = 0;
+
+
+#if WITH_TELEMETRY
+
+// Periodic telemetry.
+//
+// Once subscribed, a packet (see frame.h) is sent every 1000/rate ms
+// from the main loop, whatever protocol is in use; a host reading text
+// replies at the same time can pick packets out by their zero
+// terminators.  Payload, 16-bit values little-endian:
+//
+//   0      TELEMETRY_PACKET
+//   1      sequence number, to spot lost packets
+//   2-3    tick_now()
+//   4      TELEMETRY_F_* flags
+//   5      battlevel
+//   6-7    velocity
+//   8-9    steerposition
+//   10     looptime, ms
+//   11     looptimemax, ms, since the last packet
+//   12-21  uart error counts, as struct uart_errors
+//
+// The rate is limited to TELEMETRY_RATE_MIN..TELEMETRY_RATE_MAX Hz, and
+// to what three quarters of the current baud rate can carry.
+
+#define TELEMETRY_PACKET		(0x80)
+#define TELEMETRY_LEN			(22)
+#define TELEMETRY_RATE_MIN		(10)
+#define TELEMETRY_RATE_MAX		(200)
+
+#define TELEMETRY_F_CONNECTED	_BV(0) // bluetooth_connected()
+#define TELEMETRY_F_BATTLOW		_BV(1) // motors stopped for low battery
+
+static uint8_t telemetryrequested = 0; // Hz, 0 off
+static uint8_t telemetryrate = 0; // Hz, after limits
+static uint16_t telemetryperiod = 0; // ms
+static uint16_t telemetrynext = 0;
+static uint8_t telemetryseq = 0;
+
+static uint8_t telemetry_rate_limit() {
+	uint16_t limit = uart_baud_cps(uart_baud_current()) / 4 * 3
+			/ FRAME_ENCODED_MAX(TELEMETRY_LEN);
+	return (limit < TELEMETRY_RATE_MAX) ? limit : TELEMETRY_RATE_MAX;
+}
+
+/** subscribe at rate Hz, 0 to stop; returns the rate actually used */
+static uint8_t telemetry_subscribe(uint8_t rate) {
+	telemetryrequested = rate;
+
+	if (rate == 0) {
+		telemetryrate = 0;
+		return 0;
+	}
+
+	uint8_t limit = telemetry_rate_limit();
+	if (rate < TELEMETRY_RATE_MIN) rate = TELEMETRY_RATE_MIN;
+	if (rate > limit) rate = limit;
+
+	telemetryrate = rate;
+	telemetryperiod = 1000 / rate;
+	telemetrynext = tick_now();
+	return rate;
+}
+
+static uint8_t telemetry_put16(uint8_t *p, uint16_t v) {
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+	return 2;
+}
+
+static void telemetry_send() {
+	uint8_t r[TELEMETRY_LEN];
+	uint8_t n = 0;
+	struct uart_errors e;
+	uart_get_errors(&e, 0);
+
+	r[n++] = TELEMETRY_PACKET;
+	r[n++] = telemetryseq++;
+	n += telemetry_put16(r + n, tick_now());
+	r[n++] = (bluetooth_connected() ? TELEMETRY_F_CONNECTED : 0)
+			| (battlow ? TELEMETRY_F_BATTLOW : 0);
+	r[n++] = battlevel;
+	n += telemetry_put16(r + n, drive_coarse(motor_drive_velocity()));
+	n += telemetry_put16(r + n, motor_steer_position());
+	r[n++] = looptime;
+	r[n++] = looptimemax;
+	n += telemetry_put16(r + n, e.frame);
+	n += telemetry_put16(r + n, e.overrun);
+	n += telemetry_put16(r + n, e.parity);
+	n += telemetry_put16(r + n, e.rxoverflow);
+	n += telemetry_put16(r + n, e.txdropped);
+
+	uint8_t out[FRAME_ENCODED_MAX(TELEMETRY_LEN)];
+	uart_write(out, frame_encode(r, n, out));
+
+	looptimemax = 0;
+}
+
+// Called once per main loop pass.
+static void telemetry_tick() {
+	if (!telemetryrate) return;
+
+	uint16_t now = tick_now();
+	if ((int16_t) (now - telemetrynext) < 0) return;
+
+	telemetry_send();
+
+	// if we've fallen a whole period behind, don't try to catch up
+	telemetrynext += telemetryperiod;
+	if ((int16_t) (now - telemetrynext) >= 0) telemetrynext = now + telemetryperiod;
+}
+
+#else
+
+#define telemetry_tick()
+
+#endif // WITH_TELEMETRY
+
+
+#define DAGU_DIR_0_STOP_STRAIGHT	(0x0)
+#define DAGU_DIR_1_FORW_STRAIGHT	(0x1)
+#define DAGU_DIR_2_BACK_STRAIGHT	(0x2)
+#define DAGU_DIR_3_STOP_LEFT		(0x3)
+#define DAGU_DIR_4_STOP_RIGHT		(0x4)
+#define DAGU_DIR_5_FORW_LEFT		(0x5)
+#define DAGU_DIR_6_FORW_RIGHT		(0x6)
+#define DAGU_DIR_7_BACK_LEFT		(0x7)
+#define DAGU_DIR_8_BACK_RIGHT		(0x8)
+#define DAGU_DIR_F_EXT_ESCAPE		(0xf)
+
+// The value for DAGU_EXT_REPORT is chosen to be the same as
+// DAGU_DIR_0_STOP_STRAIGHT control byte so that it is harmless if
+// sent to a car running the original firmware not supporting the
+// extension escape byte.  No other escape+extension sequence
+// should be attempted unless a response from the DAGU_EXT_REPORT
+// reports capability to do so.
+#define DAGU_EXT_REPORT				(0x00)
+
+#define DAGU_EXT_PROTOCOL_SWITCH_1	(0x01)
+#define DAGU_EXT_PROTOCOL_Q_BATT	(0x02)
+
+// Baud rate negotiation.  DAGU_EXT_BAUD_PROPOSE answers "baud=N\n"
+// with the fastest rate the usart can run at within tolerance, and
+// "baudfail=N\n", switches the module never answered or that fell
+// back.  The host answers with DAGU_EXT_BAUD_ACCEPT, answered
+// "baudpending=N\n", and then disconnects: the bluetooth module only
+// takes AT commands with no client connected, so the switch is made
+// after the link drops, see baud_tick().  The host must reconnect and
+// send a byte within baudtrialtimeout ms or both fall back to 9600.
+// The rate the host sees over bluetooth is unchanged; only the module
+// to usart link speeds up.
+#define DAGU_EXT_BAUD_PROPOSE		(0x03)
+#define DAGU_EXT_BAUD_ACCEPT		(0x04)
+
+// Serial line error counts, see uart_get_errors().  The _RESET
+// variant zeroes the counts after reporting them.
+#define DAGU_EXT_Q_UART_ERRORS		(0x05)
+#define DAGU_EXT_Q_UART_ERRORS_RESET	(0x06)
+
+#define DAGU_EXT_PROTOCOL_SWITCH_FRAMED	(0x07)
+#define DAGU_EXT_PROTOCOL_SWITCH_SETPOINT	(0x08)
+
+// Link latency probe.  The byte after DAGU_EXT_PING is a sequence
+// number, echoed back as "ping=N\nrx=T\ntx=T\n" where rx is the tick
+// (ms, see tick.h) the sequence byte arrived and tx the tick the reply
+// was queued.
+#define DAGU_EXT_PING				(0x09)
+
+// Binary form of DAGU_EXT_REPORT, sent as a packet (see frame.h) of
+// CAPS_BINARY_LEN bytes:
+//
+//   0    DAGU_EXT_VERSION
+//   1-4  CAP_* bits, little-endian
+//   5    fastest usable baud rate, a UART_BAUD_* index
+//   6-7  receive buffer size
+//   8-9  transmit queue size
+//   10   largest framed packet
+//   11-12 telemetry rate range in Hz, at the current baud rate; 0 if none
+#define DAGU_EXT_REPORT_BINARY		(0x0a)
+
+// Periodic telemetry.  The byte after DAGU_EXT_TELEMETRY is the rate
+// in Hz, 0 to stop; answered with "telemetry=N\n", the rate granted.
+#define DAGU_EXT_TELEMETRY			(0x0b)
+
+// Timed setpoint queue.  Entries are added through the framed
+// protocol.  DAGU_EXT_Q_TRAJECTORY answers "traj=N\nfree=N\ntrajovf=N\n",
+// entries waiting, room left and appends lost to a full queue.
+#define DAGU_EXT_TRAJECTORY_CLEAR	(0x0c)
+#define DAGU_EXT_Q_TRAJECTORY		(0x0d)
+
+// Dead-man timeout.  The byte after DAGU_EXT_DEADMAN is the timeout in
+// units of 10 ms, 0 off; answered with "deadman=MS\ntimeouts=N\n".
+#define DAGU_EXT_DEADMAN			(0x0e)
+
+// 0x0f and 0x10 are unused.
+
+// Settings, see config_set().  Takes a length byte then the CONFIG_*
+// key and its value as one byte, or two little-endian.  For example
+// 0xf0 0x11 0x03 0x02 0xf4 0x01 sets a 500 ms dead-man timeout.
+#define DAGU_EXT_CONFIG				(0x11)
+
+// PWM carriers, see CONFIG_DRIVE_CARRIER; answered with
+// "drivepwm=HZ\ndrivesteps=N\nsteerpwm=HZ\n".
+#define DAGU_EXT_Q_PWM				(0x12)
+
+// Velocity to duty calibration, see CONFIG_DRIVE_CAL; answered with
+// "drivecal=S,M,GF,GR,E\nsteercal=S,M,GF,GR,E\n", the CAL_* fields
+// in order.
+#define DAGU_EXT_Q_CAL				(0x13)
+
+// Steering hold, see CONFIG_STEER_HOLD; answered with "held=S\nsaved=J\n",
+// time spent at the hold duty and the estimated energy saved by it.  The
+// _RESET variant zeroes them after.
+#define DAGU_EXT_Q_STEER_HOLD		(0x14)
+#define DAGU_EXT_Q_STEER_HOLD_RESET	(0x15)
+
+
+// Extension set version, first byte of DAGU_EXT_REPORT_BINARY.  This
+// one has 32 CAP_* bits and the CAPS_BINARY_LEN layout above.
+#define DAGU_EXT_VERSION	(3)
+
+#define CAP_PROTOCOL_1		((uint32_t) 1 << 0) // DAGU_EXT_PROTOCOL_SWITCH_1
+#define CAP_BATT			((uint32_t) 1 << 1) // DAGU_EXT_PROTOCOL_Q_BATT
+#define CAP_UART_ERRORS		((uint32_t) 1 << 2) // DAGU_EXT_Q_UART_ERRORS(_RESET)
+#define CAP_PING			((uint32_t) 1 << 3) // DAGU_EXT_PING
+#define CAP_BAUD			((uint32_t) 1 << 4) // DAGU_EXT_BAUD_PROPOSE/ACCEPT
+#define CAP_FRAMED			((uint32_t) 1 << 5) // DAGU_EXT_PROTOCOL_SWITCH_FRAMED
+#define CAP_SETPOINT		((uint32_t) 1 << 6) // DAGU_EXT_PROTOCOL_SWITCH_SETPOINT
+#define CAP_TELEMETRY		((uint32_t) 1 << 7) // DAGU_EXT_TELEMETRY
+#define CAP_TRAJECTORY		((uint32_t) 1 << 8) // DAGU_EXT_TRAJECTORY_CLEAR/Q_TRAJECTORY
+#define CAP_DEADMAN			((uint32_t) 1 << 9) // DAGU_EXT_DEADMAN
+// bit 10 is unused
+#define CAP_CONFIG			((uint32_t) 1 << 11) // DAGU_EXT_CONFIG
+#define CAP_DETECT			((uint32_t) 1 << 12) // PROTOCOL_DETECT, CONFIG_AUTODETECT
+#define CAP_SLEW			((uint32_t) 1 << 13) // CONFIG_DRIVE_SLEW, CONFIG_STEER_SLEW
+#define CAP_DRIVE_FINE		((uint32_t) 1 << 14) // FRAMED_DRIVE_FINE
+#define CAP_CARRIER			((uint32_t) 1 << 15) // CONFIG_*_CARRIER, DAGU_EXT_Q_PWM
+#define CAP_CAL				((uint32_t) 1 << 16) // CONFIG_*_CAL, DAGU_EXT_Q_CAL
+#define CAP_STOP			((uint32_t) 1 << 17) // CONFIG_DRIVE_STOP/BRAKE/REVERSE
+#define CAP_STEER_HOLD		((uint32_t) 1 << 18) // CONFIG_STEER_*, DAGU_EXT_Q_STEER_HOLD(_RESET)
+
+#if WITH_BAUD_NEGOTIATION
+#define CAPS_BAUD		CAP_BAUD
+#define CAPS_BAUD_TEXT	",baud"
+#define caps_max_baud()	uart_baud_fastest()
+#else
+#define CAPS_BAUD		(0)
+#define CAPS_BAUD_TEXT	""
+#define caps_max_baud()	UART_BAUD_9600
+#endif
+
+#if WITH_PROTOCOL_FRAMED
+#define CAPS_FRAMED			(CAP_FRAMED | CAP_DRIVE_FINE)
+#define CAPS_FRAMED_TEXT	",framed,drivefine"
+#else
+#define CAPS_FRAMED			(0)
+#define CAPS_FRAMED_TEXT	""
+#endif
+
+#if WITH_PROTOCOL_SETPOINT
+#define CAPS_SETPOINT		CAP_SETPOINT
+#define CAPS_SETPOINT_TEXT	",setpoint"
+#else
+#define CAPS_SETPOINT		(0)
+#define CAPS_SETPOINT_TEXT	""
+#endif
+
+#if WITH_TELEMETRY
+#define CAPS_TELEMETRY		CAP_TELEMETRY
+#define CAPS_TELEMETRY_TEXT	",telemetry"
+#else
+#define CAPS_TELEMETRY		(0)
+#define CAPS_TELEMETRY_TEXT	""
+#endif
+
+// only appended to by FRAMED_TRAJ_APPEND, so useless without framed
+#if WITH_TRAJECTORY && WITH_PROTOCOL_FRAMED
+#define CAPS_TRAJECTORY			CAP_TRAJECTORY
+#define CAPS_TRAJECTORY_TEXT	",traj"
+#else
+#define CAPS_TRAJECTORY			(0)
+#define CAPS_TRAJECTORY_TEXT	""
+#endif
+
+#define CAPS (CAP_PROTOCOL_1 | CAP_BATT | CAP_UART_ERRORS | CAP_PING | CAP_DEADMAN \
+	| CAP_CONFIG | CAP_DETECT | CAP_SLEW | CAP_CARRIER \
+	| CAP_CAL | CAP_STOP | CAP_STEER_HOLD \
+	| CAPS_BAUD | CAPS_FRAMED | CAPS_SETPOINT | CAPS_TELEMETRY \
+	| CAPS_TRAJECTORY)
+
+#define CAPS_BINARY_LEN (13)
+
+
+// compat dagu extension parser stage
+#define EXT_IDLE	(0) // next byte is a control byte
+#define EXT_OPCODE	(1) // escape seen
+#define EXT_LENGTH	(2)
+#define EXT_ARG		(3)
+
+static uint8_t extstage = EXT_IDLE;
+
+static void report_deadman() {
+	uart_send_P(PSTR("deadman="));  uart_senduint(deadmantimeout);  uart_sendch('\n');
+	uart_send_P(PSTR("timeouts=")); uart_senduint(deadmantimeouts); uart_sendch('\n');
+}
+
+static void report_capabilities() {
+	uart_send_P(PSTR("ver=")); uart_senduint(DAGU_EXT_VERSION); uart_sendch('\n');
+	uart_send_P(PSTR("cap=proto1,batt,uerr,ping,deadman,config,detect,slew,carrier,cal,stop,hold"
+		CAPS_BAUD_TEXT CAPS_FRAMED_TEXT CAPS_SETPOINT_TEXT CAPS_TELEMETRY_TEXT
+		CAPS_TRAJECTORY_TEXT "\n"));
+	uart_send_P(PSTR("maxbaud=")); uart_sendbaud(caps_max_baud()); uart_sendch('\n');
+	uart_send_P(PSTR("rxbuf=")); uart_senduint(UART_RX_BUFSIZE); uart_sendch('\n');
+	uart_send_P(PSTR("txbuf=")); uart_senduint(UART_TX_BUFSIZE); uart_sendch('\n');
+	uart_send_P(PSTR("frame=")); uart_senduint(FRAME_MAX); uart_sendch('\n');
+#if WITH_TELEMETRY
+	uart_send_P(PSTR("telemetry=")); uart_senduint(TELEMETRY_RATE_MIN);
+	uart_sendch('-'); uart_senduint(telemetry_rate_limit()); uart_sendch('\n');
+#endif
+}
+
+static uint8_t capabilities(uint8_t *r) {
+	r[0] = DAGU_EXT_VERSION;
+	r[1] = CAPS & 0xff;
+	r[2] = (CAPS >> 8) & 0xff;
+	r[3] = (CAPS >> 16) & 0xff;
+	r[4] = CAPS >> 24;
+	r[5] = caps_max_baud();
+	r[6] = UART_RX_BUFSIZE & 0xff;
+	r[7] = UART_RX_BUFSIZE >> 8;
+	r[8] = UART_TX_BUFSIZE & 0xff;
+	r[9] = UART_TX_BUFSIZE >> 8;
+	r[10] = FRAME_MAX;
+#if WITH_TELEMETRY
+	r[11] = TELEMETRY_RATE_MIN;
+	r[12] = telemetry_rate_limit();
+#else
+	r[11] = 0;
+	r[12] = 0;
+#endif
+	return CAPS_BINARY_LEN;
+}
+
+static void report_capabilities_binary() {
+	uint8_t r[CAPS_BINARY_LEN];
+	uint8_t out[FRAME_ENCODED_MAX(CAPS_BINARY_LEN)];
+	uint8_t n = capabilities(r);
+	uart_write(out, frame_encode(r, n, out));
+}
+
+static void report_ping(uint8_t seq) {
+	uint16_t rx = uart_rx_tick();
+	uint16_t tx = tick_now();
+	uart_send_P(PSTR("ping=")); uart_senduint(seq); uart_sendch('\n');
+	uart_send_P(PSTR("rx="));   uart_senduint(rx);  uart_sendch('\n');
+	uart_send_P(PSTR("tx="));   uart_senduint(tx);  uart_sendch('\n');
+}
+
+#if WITH_PROTOCOL_FRAMED
+static struct frame_decoder framedecoder;
+#endif
+#if WITH_PROTOCOL_SETPOINT
+static uint8_t setpointlen = 0;
+#endif
+
+// Protocol ids, as used by CONFIG_PROTOCOL and the setpoint
+// protocol's switch message.
+#define PROTOCOL_COMPAT_DAGU	(0)
+#define PROTOCOL_1				(1)
+#define PROTOCOL_FRAMED			(2)
+#define PROTOCOL_SETPOINT		(3)
+#define PROTOCOL_DETECT			(4) // picks one of the above, see handle_char_detect()
+
+static void protocol_reset_compat_dagu() {
+	extstage = EXT_IDLE;
+}
+
+#if WITH_PROTOCOL_FRAMED
+static void protocol_reset_framed() {
+	frame_decoder_reset(&framedecoder);
+}
+#endif
+
+#if WITH_PROTOCOL_SETPOINT
+static void protocol_reset_setpoint() {
+	setpointlen = 0;
+}
+#endif
+
+static void protocol_reset_detect();
+
+// The protocols built in, by PROTOCOL_* id.  Each is switched to with
+// its state reset.
+struct protocol {
+	protohandler_t handler;
+	void (*reset)(void); // or 0 if it keeps no state
+};
+
+static const struct protocol protocols[] PROGMEM = {
+	[PROTOCOL_COMPAT_DAGU]	= { &handle_char_compat_dagu, &protocol_reset_compat_dagu },
+	[PROTOCOL_1]			= { &handle_char_protocol_1, 0 },
+#if WITH_PROTOCOL_FRAMED
+	[PROTOCOL_FRAMED]		= { &handle_char_framed, &protocol_reset_framed },
+#endif
+#if WITH_PROTOCOL_SETPOINT
+	[PROTOCOL_SETPOINT]		= { &handle_char_setpoint, &protocol_reset_setpoint },
+#endif
+	[PROTOCOL_DETECT]		= { &handle_char_detect, &protocol_reset_detect },
+};
+
+#define PROTOCOL_COUNT (sizeof(protocols) / sizeof(protocols[0]))
+
+static uint8_t protocolcurrent = PROTOCOL_COMPAT_DAGU;
+static uint8_t autodetect = 0; // PROTOCOL_DETECT while bluetooth is down
+
+// Switches protocol; ids not built in are ignored.
+static void protocol_select(uint8_t protocol) {
+	if (protocol >= PROTOCOL_COUNT) return;
+
+	const struct protocol *p = &protocols[protocol];
+	protohandler_t h = (protohandler_t)pgm_read_ptr(&p->handler);
+	void (*reset)(void) = (void (*)(void))pgm_read_ptr(&p->reset);
+	if (!h) return;
+
+	if (reset) reset();
+	handler = h;
+	protocolcurrent = protocol;
+}
+
+/** seconds held at steerhold, and the estimated energy that saved in
+ * joules, since the last reset */
+static void steer_hold_counts(uint16_t *held, uint16_t *saved, uint8_t reset) {
+	uint32_t ms, full;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ms = steerheldms;
+		full = steersavedms;
+		if (reset) {
+			steerheldms = 0;
+			steersavedsq = 0;
+			steersavedms = 0;
+		}
+	}
+	full /= 1000; // s at full duty
+	uint32_t j = (full > 0xffffffff / 0xffff) ? 0xffffffff : full * steerstallmw / 1000;
+	*held = (ms / 1000 > 0xffff) ? 0xffff : ms / 1000;
+	*saved = (j > 0xffff) ? 0xffff : j;
+}
+
+static void report_steer_hold(uint8_t reset) {
+	uint16_t held, saved;
+	steer_hold_counts(&held, &saved, reset);
+	uart_send_P(PSTR("held="));  uart_senduint(held);  uart_sendch('\n');
+	uart_send_P(PSTR("saved=")); uart_senduint(saved); uart_sendch('\n');
+}
+
+// Settings, by DAGU_EXT_CONFIG or FRAMED_CONFIG.  Unknown keys are
+// ignored.
+#define CONFIG_PROTOCOL		(0x00) // a PROTOCOL_* id
+#define CONFIG_TELEMETRY	(0x01) // telemetry rate in Hz, 0 off
+#define CONFIG_DEADMAN		(0x02) // dead-man timeout in ms, 0 off
+#define CONFIG_AUTODETECT	(0x03) // 1 to autodetect protocol on connect, 0 not (default)
+#define CONFIG_DRIVE_SLEW	(0x04) // drive slew rate, 1/256 steps per ms, 0 no limit
+#define CONFIG_STEER_SLEW	(0x05) // as CONFIG_DRIVE_SLEW, for steering
+#define CONFIG_DRIVE_CARRIER	(0x06) // index into drive_carriers, saved
+#define CONFIG_STEER_CARRIER	(0x07) // index into steer_carriers, saved
+#define CONFIG_CAL_DEFAULTS	(0x08) // any value; both motors' calibration to the defaults, saved
+#define CONFIG_DRIVE_STOP	(0x09) // a DRIVE_STOP_* mode
+#define CONFIG_DRIVE_BRAKE	(0x0a) // ms braking before coasting, DRIVE_STOP_BRAKE_COAST
+#define CONFIG_DRIVE_REVERSE	(0x0b) // ms stopped between directions
+#define CONFIG_STEER_SETTLE	(0x0c) // ms at full steering duty before the hold
+#define CONFIG_STEER_HOLD	(0x0d) // steering hold duty, 0..255, 255 no hold
+#define CONFIG_STEER_STALL	(0x0e) // steering stall power at full duty in mW, for the estimate
+#define CONFIG_DRIVE_CAL	(0x10) // plus a CAL_* field, 0..255: drive calibration, saved
+#define CONFIG_STEER_CAL	(0x18) // as CONFIG_DRIVE_CAL, for steering
+
+static void config_set(uint8_t key, int16_t value) {
+	switch (key) {
+	case CONFIG_PROTOCOL:
+		protocol_select(value);
+		break;
+	case CONFIG_DEADMAN:
+		deadman_set_timeout(value < 0 ? 0 : value);
+		break;
+	case CONFIG_AUTODETECT:
+		autodetect = (value != 0);
+		break;
+	case CONFIG_DRIVE_SLEW:
+		slew_set_rate(&driveslew, ((uint16_t) value > 0xffff / DRIVE_PER_STEP)
+				? 0xffff : (uint16_t) value * DRIVE_PER_STEP);
+		break;
+	case CONFIG_STEER_SLEW:
+		slew_set_rate(&steerslew, value);
+		break;
+	case CONFIG_DRIVE_CARRIER:
+		pwm_drive_carrier_save(value);
+		break;
+	case CONFIG_STEER_CARRIER:
+		pwm_steer_carrier_save(value);
+		break;
+	case CONFIG_CAL_DEFAULTS:
+		cal_defaults_save();
+		break;
+	case CONFIG_DRIVE_STOP:
+		drive_stop_set(value);
+		break;
+	case CONFIG_DRIVE_BRAKE:
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			drivebrakems = (value < 0) ? 0 : value;
+		}
+		break;
+	case CONFIG_DRIVE_REVERSE:
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			drivereversems = (value < 0) ? 0 : value;
+		}
+		break;
+	case CONFIG_STEER_SETTLE:
+		steer_hold_set((value < 0) ? 0 : value, steerhold);
+		break;
+	case CONFIG_STEER_HOLD:
+		steer_hold_set(steersettlems, (value < 0) ? 0 : (value > 0xff) ? 0xff : value);
+		break;
+	case CONFIG_STEER_STALL:
+		steerstallmw = (value < 0) ? 0 : value;
+		break;
+#if WITH_TELEMETRY
+	case CONFIG_TELEMETRY:
+		telemetry_subscribe(value < 0 ? 0 : value > 0xff ? 0xff : value);
+		break;
+#endif
+	default:
+		if (key >= CONFIG_STEER_CAL) {
+			cal_steer_set_save(key - CONFIG_STEER_CAL, value);
+		} else if (key >= CONFIG_DRIVE_CAL) {
+			cal_drive_set_save(key - CONFIG_DRIVE_CAL, value);
+		}
+		break;
+	}
+}
+
+static void report_uart_errors(uint8_t reset) {
+	struct uart_errors e;
+	uart_get_errors(&e, reset);
+
+	uart_send_P(PSTR("fe="));     uart_senduint(e.frame);      uart_sendch('\n');
+	uart_send_P(PSTR("dor="));    uart_senduint(e.overrun);    uart_sendch('\n');
+	uart_send_P(PSTR("upe="));    uart_senduint(e.parity);     uart_sendch('\n');
+	uart_send_P(PSTR("rxovf="));  uart_senduint(e.rxoverflow); uart_sendch('\n');
+	uart_send_P(PSTR("txdrop=")); uart_senduint(e.txdropped);  uart_sendch('\n');
+}
+
+#if WITH_BAUD_NEGOTIATION
+
+// Baud rate switch.
+//
+// With a rate pending and the link down (the connected pin low), the
+// module is sent AT+BAUDn at the current rate.  It answers "OK" and
+// the new rate, still at the old one, and then changes; once its
+// answer has been quiet for baudsettle ms the usart follows.  With no
+// "OK" within baudreplytimeout ms (a client connected after all, say)
+// nothing changes.  Received bytes go no further than baud_filter()
+// while the switch is under way.
+//
+// The new rate is then on trial: it is kept in eeprom, for the next
+// boot, only once a byte arrives at it.  With none within
+// baudtrialtimeout ms both go back to 9600 the same way, AT+BAUD4 at
+// the new rate once the link is down, and the usart to 9600 whether
+// or not the module answers.  A rate loaded from eeprom at boot is on
+// trial too, so a module that lost it is found again.
+
+#define BAUD_IDLE		(0)
+#define BAUD_PENDING	(1) // waiting for the link to drop
+#define BAUD_SENT		(2) // AT+BAUDn queued, waiting for "OK"
+#define BAUD_OK			(3) // waiting for the answer to end
+#define BAUD_TRIAL		(4) // at the new rate, waiting for a byte
+
+#define baudreplytimeout (2000) // the module waits 1 s for more command
+#define baudsettle (50)
+#define baudtrialtimeout (30000) // for the client to reconnect and send
+
+uint8_t EEMEM eebaud = UART_BAUD_9600;
+
+static uint8_t baudstage = BAUD_IDLE;
+static uint8_t baudproposed = UART_BAUD_9600;
+static uint8_t baudreply; // bytes of "OK" matched
+static uint16_t baudsince; // tick_now() of the stage, or the last answer byte
+static uint16_t baudfailures = 0;
+
+/** the rate saved in eeprom, for uart_init(), put on trial */
+static uint8_t baud_load() {
+	uint8_t b = eeprom_read_byte(&eebaud);
+	if (b >= UART_BAUD_COUNT) b = UART_BAUD_9600;
+	if (b != UART_BAUD_9600) {
+		baudstage = BAUD_TRIAL;
+		baudsince = 0;
+	}
+	return b;
+}
+
+static void baud_set(uint8_t baudindex) {
+	uart_set_baud(baudindex);
+#if WITH_TELEMETRY
+	// a slower rate may not carry the telemetry asked for
+	if (telemetryrequested) telemetry_subscribe(telemetryrequested);
+#endif
+}
+
+// Returns 1 if the byte was consumed and must not reach the protocol
+// handler.
+static uint8_t baud_filter(uint8_t command) {
+	if (baudstage == BAUD_TRIAL) {
+		// the usart drops bytes with frame errors, so this one is good
+		eeprom_update_byte(&eebaud, uart_baud_current());
+		baudstage = BAUD_IDLE;
+		return 0;
+	}
+	if (baudstage < BAUD_SENT) return 0;
+
+	baudsince = uart_rx_tick();
+	if (baudstage == BAUD_SENT) {
+		char expected = baudreply ? 'K' : 'O';
+		baudreply = (command == expected) ? baudreply + 1 : (command == 'O');
+		if (baudreply == 2) baudstage = BAUD_OK;
+	}
+	return 1;
+}
+
+// Called once per main loop pass.
+static void baud_tick(uint8_t connected) {
+	switch (baudstage) {
+	case BAUD_PENDING:
+		if (connected || uart_tx_pending()) break;
+		uart_send_P(PSTR("AT+BAUD")); uart_sendch(uart_baud_at_code(baudproposed));
+		baudreply = 0;
+		baudsince = tick_now();
+		baudstage = BAUD_SENT;
+		break;
+	case BAUD_SENT:
+		if ((uint16_t) (tick_now() - baudsince) > baudreplytimeout) {
+			baudstage = BAUD_IDLE;
+			if (baudproposed != UART_BAUD_9600) {
+				if (baudfailures != 0xffff) baudfailures++;
+			} else if (uart_baud_current() != UART_BAUD_9600) {
+				// falling back: the module never left 9600, or is lost
+				baud_set(UART_BAUD_9600);
+				eeprom_update_byte(&eebaud, UART_BAUD_9600);
+			}
+		}
+		break;
+	case BAUD_OK:
+		if ((uint16_t) (tick_now() - baudsince) > baudsettle && uart_tx_idle()) {
+			baud_set(baudproposed);
+			if (baudproposed == UART_BAUD_9600) {
+				eeprom_update_byte(&eebaud, UART_BAUD_9600);
+				baudstage = BAUD_IDLE;
+			} else {
+				baudsince = tick_now();
+				baudstage = BAUD_TRIAL;
+			}
+		}
+		break;
+	case BAUD_TRIAL:
+		if ((uint16_t) (tick_now() - baudsince) > baudtrialtimeout) {
+			if (baudfailures != 0xffff) baudfailures++;
+			baudproposed = UART_BAUD_9600;
+			baudstage = BAUD_PENDING;
+		}
+		break;
+	}
+}
+
+#else
+
+#define baud_load() UART_BAUD_9600
+#define baud_filter(command) (0)
+#define baud_tick(connected)
+
+#endif // WITH_BAUD_NEGOTIATION
+
+// Command dispatch for compat dagu and protocol_1 is table driven:
+// each received byte indexes a flash table giving the action and its
+// argument, so every byte costs the same couple of loads and one
+// indirect call whatever its value.  New commands need only a table
+// entry (and a function, for a new action).
+
+// Compat dagu control byte, high nibble: which way to drive and steer.
+// The low nibble is the speed grade.
+struct dagu_dir {
+	int8_t drive; // -1, 0 or 1 times the speed grade
+	int8_t steer; // -1, 0 or 1 times full lock
+	uint8_t op;
+};
+
+#define DAGU_OP_NONE	(0) // not a known direction, ignored
+#define DAGU_OP_MOVE	(1)
+#define DAGU_OP_ESCAPE	(2)
+
+static const struct dagu_dir dagu_dir_table[16] PROGMEM = {
+	[DAGU_DIR_0_STOP_STRAIGHT] = {  0,  0, DAGU_OP_MOVE },
+	[DAGU_DIR_1_FORW_STRAIGHT] = {  1,  0, DAGU_OP_MOVE },
+	[DAGU_DIR_2_BACK_STRAIGHT] = { -1,  0, DAGU_OP_MOVE },
+	[DAGU_DIR_3_STOP_LEFT]     = {  0, -1, DAGU_OP_MOVE },
+	[DAGU_DIR_4_STOP_RIGHT]    = {  0,  1, DAGU_OP_MOVE },
+	[DAGU_DIR_5_FORW_LEFT]     = {  1, -1, DAGU_OP_MOVE },
+	[DAGU_DIR_6_FORW_RIGHT]    = {  1,  1, DAGU_OP_MOVE },
+	[DAGU_DIR_7_BACK_LEFT]     = { -1, -1, DAGU_OP_MOVE },
+	[DAGU_DIR_8_BACK_RIGHT]    = { -1,  1, DAGU_OP_MOVE },
+	[DAGU_DIR_F_EXT_ESCAPE]    = {  0,  0, DAGU_OP_ESCAPE },
+};
+
+// Extension sequences, after DAGU_DIR_F_EXT_ESCAPE: an opcode, then
+// its argument.  The table entry gives the argument length, fixed or
+// DAGU_EXT_ARG_VAR for a length byte then that many bytes.  An
+// argument longer than DAGU_EXT_ARG_MAX is read and dropped.  A gap of
+// more than exttimeout ms abandons a sequence, so a lost byte can't
+// leave later control bytes swallowed as arguments; the byte after the
+// gap is taken as a control byte.  Opcodes left out of the build (a
+// null function), or beyond the table, do nothing with their argument.
+typedef void (*dagu_ext_t)(const uint8_t *arg, uint8_t len);
+
+struct dagu_ext {
+	dagu_ext_t fn;
+	uint8_t arglen;
+};
+
+#define DAGU_EXT_ARG_MAX	(8)
+#define DAGU_EXT_ARG_VAR	(0xff)
+
+#define exttimeout (100)
+
+static uint8_t extbuf[DAGU_EXT_ARG_MAX];
+static uint8_t extlen;
+static uint8_t extgot;
+static uint8_t extopcode;
+static uint16_t extlast;
+
+static void dagu_ext_report(const uint8_t *arg, uint8_t len) {
+	report_capabilities();
+}
+
+static void dagu_ext_switch_1(const uint8_t *arg, uint8_t len) {
+	protocol_select(PROTOCOL_1);
+}
+
+static void dagu_ext_q_batt(const uint8_t *arg, uint8_t len) {
+	uart_send_P(PSTR("batt=")); uart_sendint(battlevel); uart_sendch('\n');
+}
+
+#if WITH_BAUD_NEGOTIATION
+static void dagu_ext_baud_propose(const uint8_t *arg, uint8_t len) {
+	baudproposed = uart_baud_fastest();
+	uart_send_P(PSTR("baud="));     uart_sendbaud(baudproposed); uart_sendch('\n');
+	uart_send_P(PSTR("baudfail=")); uart_senduint(baudfailures); uart_sendch('\n');
+}
+
+static void dagu_ext_baud_accept(const uint8_t *arg, uint8_t len) {
+	baudstage = (baudproposed == uart_baud_current()) ? BAUD_IDLE : BAUD_PENDING;
+	uart_send_P(PSTR("baudpending=")); uart_sendbaud(baudproposed); uart_sendch('\n');
+}
+#else
+#define dagu_ext_baud_propose (0)
+#define dagu_ext_baud_accept (0)
+#endif
+
+static void dagu_ext_q_uart_errors(const uint8_t *arg, uint8_t len) {
+	report_uart_errors(0);
+}
+
+static void dagu_ext_q_uart_errors_reset(const uint8_t *arg, uint8_t len) {
+	report_uart_errors(1);
+}
+
+static void dagu_ext_switch_framed(const uint8_t *arg, uint8_t len) {
+	protocol_select(PROTOCOL_FRAMED);
+}
+
+static void dagu_ext_switch_setpoint(const uint8_t *arg, uint8_t len) {
+	protocol_select(PROTOCOL_SETPOINT);
+}
+
+static void dagu_ext_ping(const uint8_t *arg, uint8_t len) {
+	report_ping(arg[0]);
+}
+
+static void dagu_ext_report_binary(const uint8_t *arg, uint8_t len) {
+	report_capabilities_binary();
+}
+
+#if WITH_TELEMETRY
+static void dagu_ext_telemetry(const uint8_t *arg, uint8_t len) {
+	uart_send_P(PSTR("telemetry="));
+	uart_senduint(telemetry_subscribe(arg[0]));
+	uart_sendch('\n');
+}
+#else
+#define dagu_ext_telemetry (0)
+#endif
+
+#if WITH_TRAJECTORY
+static void dagu_ext_trajectory_clear(const uint8_t *arg, uint8_t len) {
+	trajectory_clear();
+}
+
+static void dagu_ext_q_trajectory(const uint8_t *arg, uint8_t len) {
+	uart_send_P(PSTR("traj="));    uart_senduint(trajectory_depth());    uart_sendch('\n');
+	uart_send_P(PSTR("free="));    uart_senduint(trajectory_free());     uart_sendch('\n');
+	uart_send_P(PSTR("trajovf=")); uart_senduint(trajectoryoverflows);   uart_sendch('\n');
+}
+#else
+#define dagu_ext_trajectory_clear (0)
+#define dagu_ext_q_trajectory (0)
+#endif
+
+static void dagu_ext_deadman(const uint8_t *arg, uint8_t len) {
+	deadman_set_timeout(arg[0] * 10);
+	report_deadman();
+}
+
+static void dagu_ext_config(const uint8_t *arg, uint8_t len) {
+	if (len == 2) {
+		config_set(arg[0], arg[1]);
+	} else if (len == 3) {
+		config_set(arg[0], (int16_t) (arg[1] | (arg[2] << 8)));
+	}
+}
+
+static void dagu_ext_q_pwm(const uint8_t *arg, uint8_t len) {
+	uart_send_P(PSTR("drivepwm="));   uart_senduint(pwm_drive_hz());   uart_sendch('\n');
+	uart_send_P(PSTR("drivesteps=")); uart_senduint(drivepwmtop);      uart_sendch('\n');
+	uart_send_P(PSTR("steerpwm="));   uart_senduint(pwm_steer_hz());   uart_sendch('\n');
+}
+
+static void report_cal(const struct motor_cal *c) {
+	const uint8_t *f = (const uint8_t *) c;
+	for (uint8_t i = 0; i < CAL_FIELDS; ++i) {
+		if (i) uart_sendch(',');
+		uart_senduint(f[i]);
+	}
+	uart_sendch('\n');
+}
+
+static void dagu_ext_q_cal(const uint8_t *arg, uint8_t len) {
+	uart_send_P(PSTR("drivecal=")); report_cal(&drivecal);
+	uart_send_P(PSTR("steercal=")); report_cal(&steercal);
+}
+
+static void dagu_ext_q_steer_hold(const uint8_t *arg, uint8_t len) {
+	report_steer_hold(0);
+}
+
+static void dagu_ext_q_steer_hold_reset(const uint8_t *arg, uint8_t len) {
+	report_steer_hold(1);
+}
+
+static const struct dagu_ext dagu_ext_table[] PROGMEM = {
+	[DAGU_EXT_REPORT]					= { &dagu_ext_report, 0 },
+	[DAGU_EXT_PROTOCOL_SWITCH_1]		= { &dagu_ext_switch_1, 0 },
+	[DAGU_EXT_PROTOCOL_Q_BATT]			= { &dagu_ext_q_batt, 0 },
+	[DAGU_EXT_BAUD_PROPOSE]				= { dagu_ext_baud_propose, 0 },
+	[DAGU_EXT_BAUD_ACCEPT]				= { dagu_ext_baud_accept, 0 },
+	[DAGU_EXT_Q_UART_ERRORS]			= { &dagu_ext_q_uart_errors, 0 },
+	[DAGU_EXT_Q_UART_ERRORS_RESET]		= { &dagu_ext_q_uart_errors_reset, 0 },
+	[DAGU_EXT_PROTOCOL_SWITCH_FRAMED]	= { &dagu_ext_switch_framed, 0 },
+	[DAGU_EXT_PROTOCOL_SWITCH_SETPOINT]	= { &dagu_ext_switch_setpoint, 0 },
+	[DAGU_EXT_PING]						= { &dagu_ext_ping, 1 },
+	[DAGU_EXT_REPORT_BINARY]			= { &dagu_ext_report_binary, 0 },
+	[DAGU_EXT_TELEMETRY]				= { dagu_ext_telemetry, 1 },
+	[DAGU_EXT_TRAJECTORY_CLEAR]			= { dagu_ext_trajectory_clear, 0 },
+	[DAGU_EXT_Q_TRAJECTORY]				= { dagu_ext_q_trajectory, 0 },
+	[DAGU_EXT_DEADMAN]					= { &dagu_ext_deadman, 1 },
+	[DAGU_EXT_CONFIG]					= { &dagu_ext_config, DAGU_EXT_ARG_VAR },
+	[DAGU_EXT_Q_PWM]					= { &dagu_ext_q_pwm, 0 },
+	[DAGU_EXT_Q_CAL]					= { &dagu_ext_q_cal, 0 },
+	[DAGU_EXT_Q_STEER_HOLD]				= { &dagu_ext_q_steer_hold, 0 },
+	[DAGU_EXT_Q_STEER_HOLD_RESET]		= { &dagu_ext_q_steer_hold_reset, 0 },
+};
+
+#define DAGU_EXT_COUNT (sizeof(dagu_ext_table) / sizeof(dagu_ext_table[0]))
+
+// Runs the extension once its argument is in, else waits for more.
+static void dagu_ext_step() {
+	if (extgot < extlen) {
+		extstage = EXT_ARG;
+		return;
+	}
+
+	extstage = EXT_IDLE;
+	if (extopcode < DAGU_EXT_COUNT && extlen <= DAGU_EXT_ARG_MAX) {
+		dagu_ext_t ext = (dagu_ext_t)pgm_read_ptr(&dagu_ext_table[extopcode].fn);
+		if (ext) ext(extbuf, extlen);
+	}
+}
+
+static void handle_char_compat_dagu(uint8_t command) {
+	uint16_t now = uart_rx_tick();
+	if (extstage != EXT_IDLE && (uint16_t) (now - extlast) > exttimeout) {
+		extstage = EXT_IDLE;
+	}
+	extlast = now;
+
+	switch (extstage) {
+	case EXT_IDLE: {
+		const struct dagu_dir *d = &dagu_dir_table[command >> 4];
+		uint8_t op = pgm_read_byte(&d->op);
+		int16_t speed = 105 + (command & 0x0f) * 1;
+
+		if (op == DAGU_OP_MOVE) {
+			mailbox_steer((int8_t)pgm_read_byte(&d->steer) * 255);
+			mailbox_drive((int8_t)pgm_read_byte(&d->drive) * speed);
+		} else if (op == DAGU_OP_ESCAPE) {
+			extstage = EXT_OPCODE;
+		}
+		break;
+	}
+
+	case EXT_OPCODE:
+		extopcode = command;
+		extgot = 0;
+		extlen = (command < DAGU_EXT_COUNT) ? pgm_read_byte(&dagu_ext_table[command].arglen) : 0;
+		if (extlen == DAGU_EXT_ARG_VAR) {
+			extstage = EXT_LENGTH;
+		} else {
+			dagu_ext_step();
+		}
+		break;
+
+	case EXT_LENGTH:
+		extlen = command;
+		dagu_ext_step();
+		break;
+
+	case EXT_ARG:
+		if (extgot < DAGU_EXT_ARG_MAX) extbuf[extgot] = command;
+		extgot++;
+		dagu_ext_step();
+		break;
+	}
+}
+
+// protocol_1 actions, each taking the argument from its table entry.
+typedef void (*proto1_action_t)(int16_t arg);
+
+#define P1_UNKNOWN		(0)
+#define P1_STEER		(1)
+#define P1_DRIVE		(2)
+#define P1_DRIVE_BY		(3)
+#define P1_STOP			(4)
+#define P1_AGE			(5)
+#define P1_HELP			(6)
+#define P1_PROTOCOL		(7)
+
+static void proto1_unknown(int16_t arg) {
+	uart_send_P(PSTR("?\n"));
+}
+
+static void proto1_drive_by(int16_t arg) {
+	mailbox_drive(mailbox_drive_target() + arg);
+}
+
+static void proto1_stop(int16_t arg) {
+	mailbox_drive(0);
+	mailbox_steer(0);
+}
+
+static void proto1_age(int16_t arg) {
+	check_magic_and_show_age();
+	age_once();
+	check_magic_and_show_age();
+}
+
+static void proto1_help(int16_t arg) {
+	uart_send_P(PSTR("steering: RrslL\ngas: FfhbB\ncompat: !\n"));
+	uart_send_P(PSTR("batt=")); uart_sendint(ADCH); uart_sendch('\n');
+	uart_send_P(PSTR("budgethits=")); uart_senduint(commandbudgethits); uart_sendch('\n');
+	uart_send_P(PSTR("coalesced=")); uart_senduint(mailboxcoalesced); uart_sendch('\n');
+	report_deadman();
+	report_uart_errors(0);
+}
+
+static void proto1_protocol(int16_t arg) {
+	protocol_select(arg);
+}
+
+static const proto1_action_t proto1_actions[] PROGMEM = {
+	[P1_UNKNOWN]	= &proto1_unknown,
+	[P1_STEER]		= &mailbox_steer,
+	[P1_DRIVE]		= &mailbox_drive,
+	[P1_DRIVE_BY]	= &proto1_drive_by,
+	[P1_STOP]		= &proto1_stop,
+	[P1_AGE]		= &proto1_age,
+	[P1_HELP]		= &proto1_help,
+	[P1_PROTOCOL]	= &proto1_protocol,
+};
+
+struct proto1_command {
+	uint8_t action;
+	int16_t arg;
+};
+
+// Indexed by the 7-bit command byte; bytes not listed are P1_UNKNOWN.
+static const struct proto1_command proto1_table[128] PROGMEM = {
+	['R'] = { P1_STEER,  255 },
+	['r'] = { P1_STEER,  127 },
+	['s'] = { P1_STEER,    0 },
+	['l'] = { P1_STEER, -127 },
+	['L'] = { P1_STEER, -255 },
+
+	['F'] = { P1_DRIVE,  255 },
+	['f'] = { P1_DRIVE,  127 },
+	['h'] = { P1_DRIVE,    0 },
+	['b'] = { P1_DRIVE, -127 },
+	['B'] = { P1_DRIVE, -255 },
+
+	// sorry, dvorak for now.
+	['a'] = { P1_STEER, -255 },
+	['o'] = { P1_STEER,    0 },
+	['e'] = { P1_STEER,  255 },
+
+	['p'] = { P1_DRIVE_BY,  5 },
+	['u'] = { P1_DRIVE_BY, -5 },
+
+	[' '] = { P1_STOP,     0 },
+	['A'] = { P1_AGE,      0 },
+	['?'] = { P1_HELP,     0 },
+	['!'] = { P1_PROTOCOL, PROTOCOL_COMPAT_DAGU },
+};
+
+static void handle_char_protocol_1(uint8_t command) {
+	const struct proto1_command *c = &proto1_table[command & 0x7f];
+	uint8_t action = (command & 0x80) ? P1_UNKNOWN : pgm_read_byte(&c->action);
+
+	((proto1_action_t)pgm_read_ptr(&proto1_actions[action]))((int16_t)pgm_read_word(&c->arg));
+}
+
+
+#if WITH_PROTOCOL_FRAMED
+
+// Framed binary protocol.
+//
+// Each packet (see frame.h) carries one or more sub-commands, each an
+// opcode byte followed by a fixed-size argument.  16-bit values are
+// little-endian.  A packet is checked in full before any of it is
+// acted on, and drive and steer are applied together at its end, so a
+// packet with both updates both axes at once.
+//
+// FRAMED_QUERY is answered with a packet of FRAMED_QUERY, the query id
+// and the data listed below.  FRAMED_PING is answered with FRAMED_PING,
+// the sequence number, and uint16 ticks (ms) of when the packet's last
+// byte arrived and when the reply was queued.
+
+#define FRAMED_DRIVE		(0x01) // int16 velocity, -255..255
+#define FRAMED_STEER		(0x02) // int16 steer position, -255..255
+#define FRAMED_QUERY		(0x03) // uint8 query id
+#define FRAMED_CONFIG		(0x04) // uint8 CONFIG_* key, int16 value
+#define FRAMED_PING			(0x05) // uint8 sequence number
+#define FRAMED_TRAJ_APPEND	(0x06) // uint16 delay ms, int16 drive, int16 steer
+#define FRAMED_TRAJ_CLEAR	(0x07) // no argument
+#define FRAMED_DRIVE_FINE	(0x08) // int16 velocity, -DRIVE_MAX..DRIVE_MAX (10-bit)
+
+#define FRAMED_Q_BATT		(0x00) // uint8 battlevel
+#define FRAMED_Q_FRAMES		(0x01) // uint16 good, corrupt, rejected packets
+#define FRAMED_Q_MOTORS		(0x02) // int16 velocity, steerposition, fine velocity
+#define FRAMED_Q_COALESCED	(0x03) // uint16 mailboxcoalesced
+#define FRAMED_Q_CAPS		(0x04) // as DAGU_EXT_REPORT_BINARY
+#define FRAMED_Q_TRAJ		(0x05) // uint8 queued, uint8 free, uint16 overflows
+#define FRAMED_Q_PWM		(0x06) // uint8 carrier, uint16 Hz, TOP (drive); uint8, uint16 Hz (steer)
+#define FRAMED_Q_CAL		(0x07) // CAL_FIELDS bytes each, drive then steering
+#define FRAMED_Q_STEER_HOLD	(0x08) // uint16 seconds held, joules saved
+
+#define FRAMED_REPLY_MAX	(16)
+
+static uint16_t framesgood = 0;
+static uint16_t framescorrupt = 0; // bad COBS, CRC or length
+static uint16_t framesrejected = 0; // good CRC, unknown or short sub-command
+
+static uint8_t framed_arglen(uint8_t opcode) {
+	switch (opcode) {
+	case FRAMED_DRIVE:  return 2;
+	case FRAMED_DRIVE_FINE: return 2;
+	case FRAMED_STEER:  return 2;
+	case FRAMED_QUERY:  return 1;
+	case FRAMED_CONFIG: return 3;
+	case FRAMED_PING:   return 1;
+#if WITH_TRAJECTORY
+	case FRAMED_TRAJ_APPEND: return 6;
+	case FRAMED_TRAJ_CLEAR:  return 0;
+#endif
+	}
+	return 0xff;
+}
+
+static int16_t framed_int16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint8_t framed_put16(uint8_t *p, uint16_t v) {
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+	return 2;
+}
+
+static void framed_reply(const uint8_t *payload, uint8_t len) {
+	uint8_t out[FRAME_ENCODED_MAX(FRAMED_REPLY_MAX)];
+	uart_write(out, frame_encode(payload, len, out));
+}
+
+static void framed_query(uint8_t what) {
+	uint8_t r[FRAMED_REPLY_MAX];
+	uint8_t n = 0;
+	r[n++] = FRAMED_QUERY;
+	r[n++] = what;
+
+	switch (what) {
+	case FRAMED_Q_BATT:
+		r[n++] = battlevel;
+		break;
+	case FRAMED_Q_FRAMES:
+		n += framed_put16(r + n, framesgood);
+		n += framed_put16(r + n, framescorrupt);
+		n += framed_put16(r + n, framesrejected);
+		break;
+	case FRAMED_Q_MOTORS: {
+		int16_t v = motor_drive_velocity();
+		n += framed_put16(r + n, drive_coarse(v));
+		n += framed_put16(r + n, motor_steer_position());
+		n += framed_put16(r + n, v);
+		break;
+	}
+	case FRAMED_Q_COALESCED:
+		n += framed_put16(r + n, mailboxcoalesced);
+		break;
+	case FRAMED_Q_CAPS:
+		n += capabilities(r + n);
+		break;
+	case FRAMED_Q_PWM:
+		r[n++] = drivecarrier;
+		n += framed_put16(r + n, pwm_drive_hz());
+		n += framed_put16(r + n, drivepwmtop);
+		r[n++] = steercarrier;
+		n += framed_put16(r + n, pwm_steer_hz());
+		break;
+	case FRAMED_Q_CAL:
+		memcpy(r + n, &drivecal, CAL_FIELDS);
+		n += CAL_FIELDS;
+		memcpy(r + n, &steercal, CAL_FIELDS);
+		n += CAL_FIELDS;
+		break;
+	case FRAMED_Q_STEER_HOLD: {
+		uint16_t held, saved;
+		steer_hold_counts(&held, &saved, 0);
+		n += framed_put16(r + n, held);
+		n += framed_put16(r + n, saved);
+		break;
+	}
+#if WITH_TRAJECTORY
+	case FRAMED_Q_TRAJ:
+		r[n++] = trajectory_depth();
+		r[n++] = trajectory_free();
+		n += framed_put16(r + n, trajectoryoverflows);
+		break;
+#endif
+	}
+
+	framed_reply(r, n);
+}
+
+static void framed_ping(uint8_t seq) {
+	uint8_t r[FRAMED_REPLY_MAX];
+	uint8_t n = 0;
+	r[n++] = FRAMED_PING;
+	r[n++] = seq;
+	n += framed_put16(r + n, uart_rx_tick());
+	n += framed_put16(r + n, tick_now());
+	framed_reply(r, n);
+}
+
+static void framed_packet(const uint8_t *p, uint8_t len) {
+
+	for (uint8_t i = 0; i < len; i += 1 + framed_arglen(p[i])) {
+		uint8_t arglen = framed_arglen(p[i]);
+		if (arglen == 0xff || arglen >= len - i) {
+			if (framesrejected != 0xffff) framesrejected++;
+			return;
+		}
+	}
+
+	uint8_t setdrive = 0;
+	uint8_t setsteer = 0;
+	int16_t drive = 0;
+	int16_t steer = 0;
+
+	for (uint8_t i = 0; i < len; i += 1 + framed_arglen(p[i])) {
+		const uint8_t *arg = p + i + 1;
+		switch (p[i]) {
+		case FRAMED_DRIVE:
+			drive = drive_fine(framed_int16(arg));
+			setdrive = 1;
+			break;
+		case FRAMED_DRIVE_FINE:
+			drive = framed_int16(arg);
+			setdrive = 1;
+			break;
+		case FRAMED_STEER:
+			steer = framed_int16(arg);
+			setsteer = 1;
+			break;
+		}
+	}
+
+	if (setsteer) mailbox_steer(steer);
+	if (setdrive) mailbox_drive_fine(drive);
+
+	// config after setpoints, so a protocol switch doesn't strand them
+	for (uint8_t i = 0; i < len; i += 1 + framed_arglen(p[i])) {
+		const uint8_t *arg = p + i + 1;
+		switch (p[i]) {
+		case FRAMED_QUERY:
+			framed_query(arg[0]);
+			break;
+		case FRAMED_CONFIG:
+			config_set(arg[0], framed_int16(arg + 1));
+			break;
+		case FRAMED_PING:
+			framed_ping(arg[0]);
+			break;
+#if WITH_TRAJECTORY
+		case FRAMED_TRAJ_APPEND:
+			trajectory_append(framed_int16(arg), framed_int16(arg + 2), framed_int16(arg + 4));
+			break;
+		case FRAMED_TRAJ_CLEAR:
+			trajectory_clear();
+			break;
+#endif
+		}
+	}
+
+	if (framesgood != 0xffff) framesgood++;
+}
+
+static void handle_char_framed(uint8_t command) {
+	switch (frame_decode(&framedecoder, command)) {
+	case FRAME_OK:
+		framed_packet(framedecoder.buf, framedecoder.size);
+		break;
+	case FRAME_BAD:
+		if (framescorrupt != 0xffff) framescorrupt++;
+		break;
+	}
+}
+
+#endif // WITH_PROTOCOL_FRAMED
+
+
+#if WITH_PROTOCOL_SETPOINT
+
+// Setpoint protocol.
+//
+// Every message is 3 bytes and sets both axes at once from 9-bit two's
+// complement values, drive d and steer s.  Only the first byte has the
+// top bit set, so a lost byte costs one message, not sync:
+//
+//   byte 0:  1  d8 d7 d6 d5 d4 d3 d2
+//   byte 1:  0  d1 d0 s8 s7 s6 s5 s4
+//   byte 2:  0  s3 s2 s1 s0 c2 c1 c0
+//
+// c is a 3-bit check, the xor of the 3-bit groups of the other 18 bits
+// (see setpoint_check()), so any single bit error is caught.
+//
+// d = -256 is not a velocity; it switches to the protocol whose
+// PROTOCOL_* id is in s.
+
+#define SETPOINT_START		(0x80)
+#define SETPOINT_SWITCH		(-256)
+
+static uint8_t setpointbuf[2];
+static uint16_t setpointsbad = 0;
+
+static uint8_t setpoint_check(uint8_t b0, uint8_t b1, uint8_t b2) {
+	uint8_t x = (b0 & 0x7f) ^ b1 ^ (b2 & 0x78);
+	x ^= x >> 3;
+	x ^= x >> 6;
+	return x & 0x07;
+}
+
+static int16_t setpoint_int9(uint16_t v) {
+	return (v & 0x100) ? (int16_t) v - 0x200 : (int16_t) v;
+}
+
+static void handle_char_setpoint(uint8_t command) {
+
+	if (command & SETPOINT_START) {
+		if (setpointlen && setpointsbad != 0xffff) setpointsbad++;
+		setpointbuf[0] = command;
+		setpointlen = 1;
+		return;
+	}
+
+	if (setpointlen == 0) return; // waiting for a start byte
+
+	if (setpointlen == 1) {
+		setpointbuf[1] = command;
+		setpointlen = 2;
+		return;
+	}
+
+	setpointlen = 0;
+
+	uint8_t b0 = setpointbuf[0];
+	uint8_t b1 = setpointbuf[1];
+	uint8_t b2 = command;
+
+	if (setpoint_check(b0, b1, b2) != (b2 & 0x07)) {
+		if (setpointsbad != 0xffff) setpointsbad++;
+		return;
+	}
+
+	int16_t drive = setpoint_int9(((b0 & 0x7f) << 2) | (b1 >> 5));
+	int16_t steer = setpoint_int9(((b1 & 0x1f) << 4) | ((b2 >> 3) & 0x0f));
+
+	if (drive == SETPOINT_SWITCH) {
+		protocol_select(steer);
+		return;
+	}
+
+	mailbox_steer(steer);
+	mailbox_drive(drive);
+}
+
+#endif // WITH_PROTOCOL_SETPOINT
+
+// Protocol autodetection.
+//
+// With autodetect on (CONFIG_AUTODETECT, off at reset), losing the
+// bluetooth link sets PROTOCOL_DETECT, so the next client finds the
+// car listening for any protocol instead of the one the last client
+// left it in.  PD4 is low only while disconnected, though it blinks
+// then, so the first low is taken and the blinks after it leave the
+// detect state alone; it is set before any byte of the next link.
+// The first bytes are held, without driving, until they show a
+// protocol:
+//
+//  - DETECT_FRAMED_RUN framed packets in a row with a good CRC:
+//    PROTOCOL_FRAMED.  The CRC is 8 bits, so one short packet passes
+//    for corrupt or compat bytes about 1 time in 256 (see frame.h);
+//    a framed client should open with two packets, such as pings,
+//    within DETECT_MAX bytes.
+//  - DETECT_SETPOINT_RUN setpoint messages in a row, each with a good
+//    check and nothing between: PROTOCOL_SETPOINT.  The check is only
+//    3 bits, so one message passes for compat bytes 1 time in 8, and
+//    an i-Racer app stuck in setpoint mode has no way back.
+//  - anything else, once detecttimeout ms pass after the first byte
+//    (detectsetpointtimeout while setpoint messages or framed packets
+//    are still coming good) or DETECT_MAX bytes are held: the
+//    fallback, so the original i-Racer apps drive as soon as that.
+//
+// The held bytes are then handed to the protocol picked.  protocol_1
+// bytes are all valid compat bytes too, and ' ' or 'h' there would
+// drive the car as compat bytes, so protocol_1 is kept as the
+// fallback if the link was in it; otherwise the fallback is compat.
+
+#define DETECT_MAX (32) // two drive and steer packets, and more
+#define DETECT_SETPOINT_RUN (4) // 1 in 4096 for random compat bytes
+#define DETECT_FRAMED_RUN (2) // 1 in 65536 for random CRCs
+#define detecttimeout (30)
+#define detectsetpointtimeout (250)
+
+static uint8_t detectbuf[DETECT_MAX];
+static uint8_t detectlen;
+static uint8_t detectfallback = PROTOCOL_COMPAT_DAGU;
+static uint16_t detectfirst; // tick of the first held byte
+#if WITH_PROTOCOL_FRAMED
+static uint8_t detectframedgood; // good packets in a row
+#define detect_framed_coming() (detectframedgood != 0)
+#else
+#define detect_framed_coming() (0)
+#endif
+#if WITH_PROTOCOL_SETPOINT
+static uint8_t detectsetpoint[2];
+static uint8_t detectsetpointlen;
+static uint8_t detectsetpointgood; // messages in a row, 0xff once ruled out
+#define detect_setpoint_coming() (detectsetpointgood != 0 && detectsetpointgood != 0xff)
+#else
+#define detect_setpoint_coming() (0)
+#endif
+
+#define detect_timeout() \
+	((detect_setpoint_coming() || detect_framed_coming()) \
+		? detectsetpointtimeout : detecttimeout)
+
+static void protocol_reset_detect() {
+	detectlen = 0;
+#if WITH_PROTOCOL_FRAMED
+	frame_decoder_reset(&framedecoder);
+	detectframedgood = 0;
+#endif
+#if WITH_PROTOCOL_SETPOINT
+	detectsetpointlen = 0;
+	detectsetpointgood = 0;
+#endif
+}
+
+static void detect_pick(uint8_t protocol) {
+	uint8_t n = detectlen;
+	uint8_t i;
+
+	protocol_select(protocol);
+	for (i = 0; i < n; i++) {
+		(*handler)(detectbuf[i]);
+	}
+}
+
+static void handle_char_detect(uint8_t command) {
+	if (detectlen == 0) detectfirst = uart_rx_tick();
+	detectbuf[detectlen++] = command;
+
+#if WITH_PROTOCOL_FRAMED
+	switch (frame_decode(&framedecoder, command)) {
+	case FRAME_OK:
+		if (++detectframedgood == DETECT_FRAMED_RUN) {
+			detect_pick(PROTOCOL_FRAMED);
+			return;
+		}
+		break;
+	case FRAME_BAD:
+		detectframedgood = 0;
+		break;
+	}
+#endif
+
+#if WITH_PROTOCOL_SETPOINT
+	if (detectsetpointgood == 0xff) {
+		// ruled out
+	} else if ((command & SETPOINT_START) != (detectsetpointlen == 0 ? SETPOINT_START : 0)) {
+		detectsetpointgood = 0xff; // a stray or truncated message
+	} else if (detectsetpointlen < 2) {
+		detectsetpoint[detectsetpointlen++] = command;
+	} else {
+		detectsetpointlen = 0;
+		if (setpoint_check(detectsetpoint[0], detectsetpoint[1], command) != (command & 0x07)) {
+			detectsetpointgood = 0xff;
+		} else if (++detectsetpointgood == DETECT_SETPOINT_RUN) {
+			detect_pick(PROTOCOL_SETPOINT);
+			return;
+		}
+	}
+#endif
+
+	if (detectlen == DETECT_MAX) detect_pick(detectfallback);
+}
+
+// Called once per main loop pass, before input is handled, with the
+// bluetooth connected state.
+static void detect_tick(uint8_t connected) {
+	if (!connected && autodetect && protocolcurrent != PROTOCOL_DETECT) {
+		detectfallback = (protocolcurrent == PROTOCOL_1) ? PROTOCOL_1 : PROTOCOL_COMPAT_DAGU;
+		protocol_select(PROTOCOL_DETECT);
+	}
+
+	if (protocolcurrent == PROTOCOL_DETECT && detectlen
+			&& (uint16_t) (tick_now() - detectfirst) > detect_timeout()) {
+		detect_pick(detectfallback);
+	}
+}
+
+static uint8_t battlevel = 11;
+
+static void batt_sample() {
+	uint8_t battsample = ADCH;
+
+	// need to scale 142+0..142+48 -> 0..255, so *5
+	battsample -= 142;
+	if (battsample < 0) battsample = 0;
+	battsample *= 5;
+	if (battsample > 255) battsample = 255;
+
+	battlevel = battsample;
+}
+
+static uint8_t batt_low_consistently(uint8_t threshold) {
+	uint8_t warn = 0;
+	for (uint8_t i = 0; i < 20; ++i) {
+
+		delay_100us(10);
+		batt_sample();
+
+		if (battlevel < threshold) {
+			warn++;
+		}
+	}
+
+	return warn > 17;
+}
+
+
+#define battlowthreshold (10)
+
+//// breathing blue led support
+//uint8_t breathelevel = 0;
+//uint8_t breathedirection = 1;
+
+#define voltagedisplaytoggleperiodlength  (200)
+static uint8_t voltagedisplaytogglecountdown = 10;
+static uint8_t voltagedisplaytogglestate = 0;
+
+#define battwarntoggleperiodlength (20)
+static uint8_t battwarntogglecountdown = 0;
+static uint8_t battwarntogglestate = 0;
+// assume at least more than warning-threshold until 1st sample
+
+#define mainloopdelay (40)
+
+
+int main(void) {
+
+	uart_init(baud_load());
+
+	// ------------------------------------------------------------------------------
+
+	//
+	// Before main()
+	//   * SREG is set to 0x00, and
+	//   * stack-pointer SPH & SPL is assigned
+	// 6 instructions plus jump to main
+	//
+
+	// ------------------------------------------------------------------------------
+
+	cli();
+
+	// sets outputs to high or enables internal pull-ups.
+	PORTB = 0xff;
+	PORTC = 0xff;
+	PORTD = 0xff;
+
+	// sets pins as inputs initially
+	DDRB = 0;
+	DDRC = 0;
+	DDRD = 0;
+
+	// ------------------------------------------------------------------------------
+
+	// ADC channel monitoring battery charge
+
+	ADMUX = 0;
+	ADMUX |= _BV(REFS0);
+	ADMUX |= _BV(ADLAR);
+
+	ADCSRA = 0;
+	ADCSRA |= _BV(ADPS1) | _BV(ADPS0); // prescale /8
+	ADCSRA |= _BV(ADATE);
+	ADCSRB = 0; // leave in free-running mode
+	ADCSRA |= _BV(ADEN); // enable ADC
+	ADCSRA |= _BV(ADSC); // start 1st conversion, triggering free-running mode
+
+	// ------------------------------------------------------------------------------
+
+	//  PWMs on steering motor
+
+	// 8-bit PWM, mode set with the carrier, non-inverting
+	TCCR0A = _BV(COM0A1) | _BV(COM0B1);
+	TCCR0B = 0; // no clock yet // must not clobber and set WGM02
+	OCR0A = STEER_OCR(0);
+	OCR0B = STEER_OCR(0);
+	TIMSK0 = 0; // no interrupts
+	TIFR0 = 0xff; // clears match & overflow interrupt flags
+	DDRD |= _BV(DD5); // (PCINT21/OC0B/T1) PD5
+	DDRD |= _BV(DD6); // (PCINT22/OC0A/AIN0) PD6
+	// clock on at the saved carrier, below
+
+
+	// PWMs on drive motor
+
+	// fast PWM, TOP = ICR1 (mode 14), see DRIVE_PWM_TOP
+	TCCR1A = _BV(WGM11) | _BV(COM1A1) | _BV(COM1B1);
+	TCCR1B = _BV(WGM13) | _BV(WGM12); // no clock yet
+	ICR1 = drivepwmtop;
+	OCR1A = DRIVE_OCR(0);
+	OCR1B = DRIVE_OCR(0);
+	TIMSK1 = 0; // no interrupts
+	TIFR1 = 0xff; // clears match & overflow interrupt flags
+	DDRB |= _BV(DD1); // PB1 (OC1A/PCINT1)
+	DDRB |= _BV(DD2); // PB2 (SS/OC1B/PCINT2)
+
+	cal_load();
+	pwm_carriers_load(); // clocks on, timer0 and timer1
+
+
+	// PWM for 'breathing' blue led, and the millisecond tick
+
+	tick_init();
+	tick_set_hook(&control_isr);
+
+	// ------------------------------------------------------------------------------
+
+	DDRC |= _BV(led1_pin);
+	DDRC |= _BV(led2_pin);
+	DDRC |= _BV(led3_pin);
+	DDRC |= _BV(led4_pin);
+	DDRD |= _BV(led5_pin);
+
+
+	led1off();
+	led2off();
+	led3off();
+	led4off();
+	led5off();
+
+	// ------------------------------------------------------------------------------
+
+	// usart receive is interrupt-driven from here on
+	sei();
+
+	// ------------------------------------------------------------------------------
+
+	// Can only do this on board power-cycle, not just any cpu reset.
+	// If tried after only cpu reset, the bluetooth module isn't in command mode,
+	// and awaiting a response would hang the show.
+	if (0) bluetooth_setname(PSTR("OpenRacer"));
+
+	// ------------------------------------------------------------------------------
 
 	flash_reset_flag_info(resetflags, 10);
 	pulse_motor_steering(0x60, 1);
@@ -718,15 +2938,48 @@ int main(void) {
 
 	// ------------------------------------------------------------------------------
 
+	uint16_t looplast = tick_now();
+
 	while (1) {
 
 		wdt_reset();
 
+		uint16_t loopnow = tick_now();
+		uint16_t loopdelta = loopnow - looplast;
+		looplast = loopnow;
+		looptime = (loopdelta > 0xff) ? 0xff : loopdelta;
+		if (looptime > looptimemax) looptimemax = looptime;
+
 //		// breathing blue led support
 //		breathelevel += breathedirection;
 //		if (breathelevel <= 0) breathedirection = 1;
 //		if (breathelevel >= 255) breathedirection = -1;
-//		OCR2B = breathelevel;
+//		tick_led(breathelevel);
+
+
+		// Handle everything received since the last pass, so bytes
+		// sent together (e.g. steer and drive) take effect together.
+
+		detect_tick(bluetooth_connected());
+
+		uint8_t budget = commandbudget;
+		int16_t command;
+		led4on();
+		while (budget && (command = uart_read()) >= 0) {
+			--budget;
+			if (!baud_filter(command)) {
+				(*handler)(command);
+			}
+		}
+		led4off();
+
+		if (!budget && uart_available() && commandbudgethits < 0xffff) {
+			commandbudgethits++;
+		}
+
+		mailbox_apply();
+
+		baud_tick(bluetooth_connected());
 
 
 		// Bluetooth signal indicator sampling.
@@ -741,17 +2994,7 @@ int main(void) {
 			//led2on();
 		} else {
 			//led2off();
-			motor_drive_set_velocity(0);
-			motor_steer_set_velocity(0);
-		}
-
-
-		if (uart_hasch()) {
-			led4on();
-			uint8_t command = uart_getch();
-			led4off();
-
-			(*handler)(command);
+			motors_halt();
 		}
 
 
@@ -764,9 +3007,9 @@ int main(void) {
 		if (voltagedisplaytogglestate) {
 			batt_sample();
 
-			OCR2B = 0xff - battlevel;
+			tick_led(battlevel);
 		} else {
-			OCR2B = 0xff - 0xff;
+			tick_led(0xff);
 		}
 
 
@@ -776,15 +3019,19 @@ int main(void) {
 			battwarntogglestate = !battwarntogglestate;
 		}
 
+		battlow = 0;
 		if (battlevel < battlowthreshold) {
 			if (batt_low_consistently(battlowthreshold)) {
+				battlow = 1;
 				if (battwarntogglestate) led3on(); else led3off();
-				motor_drive_set_velocity(0);
-				motor_steer_set_velocity(0);
+				motors_halt();
 			}
 		}
 
 
+		telemetry_tick();
+
+
 		delay_100us(mainloopdelay);
 	}
 
@@ -0,0 +1,66 @@
+//
+//   Copyright 2012 Dave Bacon
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+#include "tick.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#if TICK_TOP > 0xff || TICK_TOP * 2 * TICK_PRESCALE * TICK_HZ != F_CPU
+#error "F_CPU does not give an exact 8-bit TICK_TOP"
+#endif
+
+static volatile uint16_t ticks = 0;
+static void (* volatile tickhook)(void) = 0;
+
+void tick_init() {
+
+	// phase-correct PWM, TOP = OCR2A (mode 5), OC2B inverted
+	TCCR2A = _BV(WGM20) | _BV(COM2B1) | _BV(COM2B0);
+	TCCR2B = 0; // no clock yet // must not clobber and set other bits (WGM*)
+	OCR2A = TICK_TOP;
+	OCR2B = TICK_TOP; // led off
+	TIMSK2 = _BV(TOIE2); // overflow, once per period
+	TIFR2 = 0xff; // clears match & overflow interrupt flags
+	DDRD |= _BV(DD3);
+	//DDRD |= _BV(DD?); // OC2A not used
+	TCCR2B = _BV(WGM22) | _BV(CS21) | _BV(CS20); // clock on, /32
+}
+
+ISR(TIMER2_OVF_vect) {
+	ticks++;
+	if (tickhook) tickhook();
+}
+
+void tick_set_hook(void (*hook)(void)) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		tickhook = hook;
+	}
+}
+
+uint16_t tick_now() {
+	uint16_t t;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		t = ticks;
+	}
+	return t;
+}
+
+void tick_led(uint8_t level) {
+	// inverted output, so OCR2B = TOP is off and 0 is fully on
+	OCR2B = TICK_TOP - (uint8_t) (((uint16_t) level * TICK_TOP) / 0xff);
+}
@@ -0,0 +1,52 @@
+//
+//   Copyright 2012 Dave Bacon
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+#ifndef __tick_h__
+#define __tick_h__
+
+#include <inttypes.h>
+
+//
+// Millisecond time base on timer2.
+//
+// Timer2 runs phase-correct PWM with OCR2A as TOP, so it overflows at
+// exactly TICK_HZ.  Its OC2B output still drives the blue LED, with a
+// duty range of 0..TICK_TOP instead of 0..255; use tick_led().
+//
+
+#ifndef F_CPU
+#error "F_CPU must be set, -DF_CPU=8000000UL as shipped"
+#endif
+
+#define TICK_HZ (1000)
+#define TICK_PRESCALE (32)
+#define TICK_TOP (F_CPU / 2 / TICK_PRESCALE / TICK_HZ)
+
+void tick_init();
+
+/** milliseconds since tick_init(), wrapping at 0xffff */
+uint16_t tick_now();
+
+/** blue LED brightness, 0 off .. 255 fully on */
+void tick_led(uint8_t level);
+
+/**
+ * Have hook called from the tick interrupt every millisecond, or none
+ * if 0.  It runs with interrupts off, so must be short.
+ */
+void tick_set_hook(void (*hook)(void));
+
+#endif // __tick_h__
@@ -15,34 +15,333 @@
 //
 
 #include "uart.h"
+#include "tick.h"
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <string.h>
 
-void uart_init(uint16_t baud) {
+#if (UART_RX_BUFSIZE & (UART_RX_BUFSIZE - 1)) != 0 || UART_RX_BUFSIZE > 128
+#error "UART_RX_BUFSIZE must be a power of two, at most 128"
+#endif
 
-	UBRR0 = 8000000UL / 16 / baud - 1; // e.g. 51 for 9600, datasheet says 51 for 8mHz FOSC, 9600, single-rate
-	UCSR0B = _BV(TXEN0) | _BV(RXEN0); // enable tx & rx
+#if (UART_TX_BUFSIZE & (UART_TX_BUFSIZE - 1)) != 0 || UART_TX_BUFSIZE > 256
+#error "UART_TX_BUFSIZE must be a power of two, at most 256"
+#endif
+
+#define UART_RX_MASK (UART_RX_BUFSIZE - 1)
+#define UART_TX_MASK (UART_TX_BUFSIZE - 1)
+
+// Receive ring buffer, filled by USART_RX_vect and drained by uart_read().
+// The ISR is the only writer of rx_head and uart_read() the only writer
+// of rx_tail, and both are single bytes, so no locking is needed.
+static volatile uint8_t rx_buf[UART_RX_BUFSIZE];
+static volatile uint16_t rx_stamp[UART_RX_BUFSIZE]; // tick_now() at arrival
+static volatile uint8_t rx_head = 0;
+static volatile uint8_t rx_tail = 0;
+static uint16_t rx_lasttick = 0;
+
+// Receive error counts, updated by USART_RX_vect.  txdropped is unused
+// here, it is kept in tx_dropped.
+static struct uart_errors rxerrors;
+
+// Transmit queue, filled by uart_write() and drained by USART_UDRE_vect.
+// tx_buf is only published to the ISR by the store to tx_head.
+static uint8_t tx_buf[UART_TX_BUFSIZE];
+static volatile uint8_t tx_head = 0;
+static volatile uint8_t tx_tail = 0;
+static uint16_t tx_dropped = 0;
+static volatile uint8_t tx_started = 0;
+
+#ifndef F_CPU
+#error "F_CPU must be set, -DF_CPU=8000000UL as shipped"
+#endif
+
+// UBRR for a baud rate with the given clocks-per-bit divisor (16 for
+// single speed, 8 for U2X0), rounded to nearest, as in the datasheet.
+#define UART_UBRR(baud, div) \
+	((F_CPU + (div) * (baud) / 2) / ((div) * (baud)) - 1)
+
+// Resulting baud rate error in tenths of a percent.
+#define UART_ERROR(baud, div) \
+	((int16_t) ((F_CPU * 1000ULL / ((div) * (UART_UBRR(baud, div) + 1)) + (baud) / 2) / (baud)) - 1000)
+
+#define UART_ABS(x) ((x) < 0 ? -(x) : (x))
+
+// Use double speed only where it gives a smaller error.
+#define UART_U2X(baud) \
+	(UART_ABS(UART_ERROR(baud, 8)) < UART_ABS(UART_ERROR(baud, 16)))
+
+#define UART_DIV(baud) (UART_U2X(baud) ? 8 : 16)
+
+// 8N1 takes 10 bit times per byte
+#define UART_BAUD_ENTRY(baud, name, at) \
+	{ UART_UBRR(baud, UART_DIV(baud)), UART_U2X(baud), \
+	  UART_ERROR(baud, UART_DIV(baud)), at, (baud) / 10, name }
+
+struct uart_baud {
+	uint16_t ubrr;
+	uint8_t u2x;
+	int8_t error;
+	uint8_t at;
+	uint16_t cps;
+	char name[7];
+};
+
+// At 8 MHz this works out the same as the datasheet's table:
+//
+//     9600       UBRR  51   0.2%
+//    19200       UBRR  25   0.2%
+//    38400       UBRR  12   0.2%
+//    57600  U2X  UBRR  16   2.1%
+//   115200  U2X  UBRR   8  -3.5%
+//
+// so with the default UART_BAUD_MAX_ERROR of 2.0% the fastest rate
+// offered is 38400.  The 'at' digits are those of the linvor firmware's AT+BAUDn.
+static const struct uart_baud uart_baud_table[UART_BAUD_COUNT] PROGMEM = {
+	UART_BAUD_ENTRY(  9600UL,   "9600", '4'),
+	UART_BAUD_ENTRY( 19200UL,  "19200", '5'),
+	UART_BAUD_ENTRY( 38400UL,  "38400", '6'),
+	UART_BAUD_ENTRY( 57600UL,  "57600", '7'),
+	UART_BAUD_ENTRY(115200UL, "115200", '8'),
+};
+
+#if UART_UBRR(9600UL, 16) > 0x0fff
+#error "F_CPU too fast for 9600 baud"
+#endif
+
+static void uart_baud_read(uint8_t baudindex, struct uart_baud *b) {
+	if (baudindex >= UART_BAUD_COUNT) baudindex = UART_BAUD_9600;
+	memcpy_P(b, &uart_baud_table[baudindex], sizeof(*b));
+}
+
+void uart_init(uint8_t baudindex) {
+
+	uart_set_baud(baudindex);
+	UCSR0B = _BV(TXEN0) | _BV(RXEN0) | _BV(RXCIE0); // enable tx & rx, rx-complete interrupt
 	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00); // asynchronous, no parity, 1 stop bit, 8 bit char size
 }
 
-void uart_sendch(uint8_t ch) {
-	loop_until_bit_is_set(UCSR0A, UDRE0);
-	UDR0 = ch;
+static uint8_t baudcurrent = UART_BAUD_9600;
+
+void uart_set_baud(uint8_t baudindex) {
+	struct uart_baud b;
+	uart_baud_read(baudindex, &b);
+	baudcurrent = (baudindex < UART_BAUD_COUNT) ? baudindex : UART_BAUD_9600;
+
+	UBRR0 = b.ubrr;
+	if (b.u2x) {
+		UCSR0A = _BV(U2X0);
+	} else {
+		UCSR0A = 0;
+	}
 }
 
-uint8_t uart_hasch() {
-	return bit_is_set(UCSR0A, RXC0);
+uint8_t uart_baud_fastest() {
+	uint8_t fastest = UART_BAUD_9600;
+	for (uint8_t i = 0; i < UART_BAUD_COUNT; ++i) {
+		if (UART_ABS(uart_baud_error(i)) <= UART_BAUD_MAX_ERROR) fastest = i;
+	}
+	return fastest;
 }
 
-uint8_t uart_getch() {
+uint8_t uart_baud_current() {
+	return baudcurrent;
+}
 
-	loop_until_bit_is_set(UCSR0A, RXC0);
+uint16_t uart_baud_cps(uint8_t baudindex) {
+	struct uart_baud b;
+	uart_baud_read(baudindex, &b);
+	return b.cps;
+}
 
-//	if (bit_is_set(UCSR0A, FE0))  ; // TODO: handle frame error.
-//	if (bit_is_set(UCSR0A, DOR0)) ; // TODO: handle data overrun error.
-//	if (bit_is_set(UCSR0A, UPE0)) ; // TODO: parity error.
+int8_t uart_baud_error(uint8_t baudindex) {
+	struct uart_baud b;
+	uart_baud_read(baudindex, &b);
+	return b.error;
+}
 
-	return UDR0;
+uint8_t uart_baud_at_code(uint8_t baudindex) {
+	struct uart_baud b;
+	uart_baud_read(baudindex, &b);
+	return b.at;
+}
+
+void uart_sendbaud(uint8_t baudindex) {
+	if (baudindex >= UART_BAUD_COUNT) baudindex = UART_BAUD_9600;
+	uart_send_P(uart_baud_table[baudindex].name);
+}
+
+uint8_t uart_tx_idle() {
+	if (uart_tx_pending() || bit_is_set(UCSR0B, UDRIE0)) return 0;
+
+	// TXC0 is never set before the first byte goes out
+	return !tx_started || bit_is_set(UCSR0A, TXC0);
+}
+
+#define saturating_inc(c) do { if ((c) != 0xffff) ++(c); } while (0)
+
+ISR(USART_RX_vect) {
+
+	uint8_t status = UCSR0A;
+	uint8_t ch = UDR0;
+
+	// bytes were lost in hardware before this one, but this one is good
+	if (bit_is_set(status, DOR0)) saturating_inc(rxerrors.overrun);
+
+	// a byte with a frame or parity error is noise, e.g. from a baud
+	// rate mismatch; don't hand it on as a command
+	if (bit_is_set(status, FE0)) {
+		saturating_inc(rxerrors.frame);
+		return;
+	}
+	if (bit_is_set(status, UPE0)) {
+		saturating_inc(rxerrors.parity);
+		return;
+	}
+
+	uint8_t next = (rx_head + 1) & UART_RX_MASK;
+
+	// drop the newest byte if the buffer is full
+	if (next != rx_tail) {
+		rx_buf[rx_head] = ch;
+		rx_stamp[rx_head] = tick_now();
+		rx_head = next;
+	} else {
+		saturating_inc(rxerrors.rxoverflow);
+	}
+}
+
+void uart_get_errors(struct uart_errors *errors, uint8_t reset) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		*errors = rxerrors;
+		if (reset) {
+			rxerrors.frame = 0;
+			rxerrors.overrun = 0;
+			rxerrors.parity = 0;
+			rxerrors.rxoverflow = 0;
+		}
+	}
+	errors->txdropped = tx_dropped;
+	if (reset) tx_dropped = 0;
+}
+
+uint8_t uart_available() {
+	return (rx_head - rx_tail) & UART_RX_MASK;
+}
+
+int16_t uart_read() {
+	uint8_t tail = rx_tail;
+	if (tail == rx_head) return -1;
+
+	uint8_t ch = rx_buf[tail];
+	rx_lasttick = rx_stamp[tail];
+	rx_tail = (tail + 1) & UART_RX_MASK;
+	return ch;
+}
+
+uint16_t uart_rx_tick() {
+	return rx_lasttick;
+}
+
+ISR(USART_UDRE_vect) {
+	uint8_t tail = tx_tail;
+
+	if (tail == tx_head) {
+		// nothing left, stop the data-register-empty interrupt
+		UCSR0B &= (uint8_t)~_BV(UDRIE0);
+		return;
+	}
+
+	// clear TXC0 (write one) so uart_tx_idle() can tell when this is out
+	UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0);
+	UDR0 = tx_buf[tail];
+	tx_started = 1;
+	tx_tail = (tail + 1) & UART_TX_MASK;
+}
+
+uint8_t uart_tx_pending() {
+	return (tx_head - tx_tail) & UART_TX_MASK;
+}
+
+uint16_t uart_tx_dropped() {
+	return tx_dropped;
+}
+
+static void tx_count_dropped(uint8_t n) {
+	uint16_t d = tx_dropped + n;
+	tx_dropped = (d < tx_dropped) ? 0xffff : d;
+}
+
+// Queues len bytes from RAM, or from flash if progmem is set.
+static uint8_t tx_write(const uint8_t *data, uint8_t len, uint8_t progmem) {
+
+	// one slot always stays free, so a write can never exceed this
+#if UART_TX_MASK < 0xff
+	if (len > UART_TX_MASK) {
+		tx_count_dropped(len);
+		return 0;
+	}
+#endif
+
+	if (len > UART_TX_MASK - uart_tx_pending()) {
+#if UART_TX_OVERFLOW == UART_TX_DROP_OLDEST
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			uint8_t free = UART_TX_MASK - uart_tx_pending();
+			if (len > free) {
+				tx_tail = (tx_tail + (len - free)) & UART_TX_MASK;
+				tx_count_dropped(len - free);
+			}
+		}
+#else
+		tx_count_dropped(len);
+		return 0;
+#endif
+	}
+
+	uint8_t head = tx_head;
+	uint16_t first = UART_TX_BUFSIZE - head; // 256 doesn't fit a byte
+	if (first > len) first = len;
+
+	if (progmem) {
+		memcpy_P(&tx_buf[head], data, first);
+		memcpy_P(&tx_buf[0], data + first, len - first);
+	} else {
+		memcpy(&tx_buf[head], data, first);
+		memcpy(&tx_buf[0], data + first, len - first);
+	}
+
+	// make sure the copy is done before the ISR can see the new head
+	__asm__ volatile("" ::: "memory");
+	tx_head = (head + len) & UART_TX_MASK;
+
+	UCSR0B |= _BV(UDRIE0);
+	return 1;
+}
+
+uint8_t uart_write(const uint8_t *data, uint8_t len) {
+	return tx_write(data, len, 0);
+}
+
+uint8_t uart_write_P(const uint8_t *data, uint8_t len) {
+	return tx_write(data, len, 1);
+}
+
+void uart_sendch(uint8_t ch) {
+	uart_write(&ch, 1);
+}
+
+uint8_t uart_hasch() {
+	return uart_available() != 0;
+}
+
+// blocks until a byte arrives; needs global interrupts enabled
+uint8_t uart_getch() {
+	int16_t ch;
+	while ((ch = uart_read()) < 0) ;
+	return ch;
 }
 
 // this may hang if the uart doesn't have the amount of data you ask
@@ -59,27 +358,90 @@ uint8_t uart_expect(char *data) {
 	return matches == count;
 }
 
+// same as uart_expect(), with data in flash
+uint8_t uart_expect_P(const char *data) {
+	uint8_t matches = 0;
+	uint8_t count = 0;
+	char expected;
+	while ((expected = pgm_read_byte(data++)) != 0) {
+		uint8_t ch = uart_getch();
+		++count;
+		if (ch == expected) ++matches;
+	}
+	return matches == count;
+}
+
 void uart_send(char *data) {
-	for (uint8_t i = 0; data[i] != 0; ++i) {
-		uart_sendch(data[i]);
+	uart_write((const uint8_t *) data, strlen(data));
+}
+
+void uart_send_P(const char *data) {
+	uart_write_P((const uint8_t *) data, strlen_P(data));
+}
+
+// Number formatting avoids 16-bit division and modulo, which have no
+// hardware support and go through slow library routines.  Decimal
+// digits are found by subtracting powers of ten, at most 9 times per
+// digit, and each number is queued with a single uart_write().
+
+static const uint16_t pow10[4] PROGMEM = { 10000, 1000, 100, 10 };
+
+// Decimal digits of v into buf, at least width digits, zero padded.
+// Returns the number of characters written, at most 5.
+static uint8_t format_uint(char *buf, uint16_t v, uint8_t width) {
+	uint8_t n = 0;
+	for (uint8_t i = 0; i < 4; ++i) {
+		uint16_t p = pgm_read_word(&pow10[i]);
+		char d = '0';
+		while (v >= p) {
+			v -= p;
+			++d;
+		}
+		if (n || d != '0' || width >= 5 - i) buf[n++] = d;
 	}
+	buf[n++] = '0' + v;
+	return n;
+}
+
+static char hexdigit(uint8_t nibble) {
+	return nibble < 10 ? '0' + nibble : 'a' - 10 + nibble;
 }
 
 void uart_sendint(int16_t v) {
+	uart_sendintw(v, 1);
+}
+
+void uart_sendintw(int16_t v, uint8_t width) {
+	char buf[6];
+	uint8_t n = 0;
+	uint16_t u = v;
 	if (v < 0) {
-		v = -v;
-		uart_sendch('-');
+		buf[n++] = '-';
+		u = -u; // unsigned, so -32768 comes out right
 	}
+	n += format_uint(buf + n, u, width);
+	uart_write((const uint8_t *) buf, n);
+}
 
-	uint8_t th = '0' + (v%10000)/1000;
-	uint8_t h  = '0' + (v%1000 )/ 100;
-	uint8_t t  = '0' + (v%100  )/  10;
-	uint8_t o  = '0' + (v%10   )/   1;
+void uart_senduint(uint16_t v) {
+	uart_senduintw(v, 1);
+}
 
-	uint8_t n = 0;
-	if (n || th != '0') { n = 1; uart_sendch(th); }
-	if (n || h != '0') { n = 1; uart_sendch(h); }
-	if (n || t != '0') { n = 1; uart_sendch(t); }
-	uart_sendch(o);
+void uart_senduintw(uint16_t v, uint8_t width) {
+	char buf[5];
+	uint8_t n = format_uint(buf, v, width);
+	uart_write((const uint8_t *) buf, n);
 }
 
+void uart_sendhex8(uint8_t v) {
+	char buf[2] = { hexdigit(v >> 4), hexdigit(v & 0x0f) };
+	uart_write((const uint8_t *) buf, 2);
+}
+
+void uart_sendhex16(uint16_t v) {
+	char buf[4] = {
+		hexdigit(v >> 12), hexdigit((v >> 8) & 0x0f),
+		hexdigit((v >> 4) & 0x0f), hexdigit(v & 0x0f)
+	};
+	uart_write((const uint8_t *) buf, 4);
+}
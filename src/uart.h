@@ -20,11 +20,117 @@
 #include <inttypes.h>
 
 
-void uart_init(uint16_t baud);
+// Size of the interrupt-fed receive ring buffer.  Must be a power of two.
+// One slot is kept free to tell full from empty.
+#ifndef UART_RX_BUFSIZE
+#define UART_RX_BUFSIZE (32)
+#endif
 
+// Size of the interrupt-drained transmit queue.  Must be a power of two.
+#ifndef UART_TX_BUFSIZE
+#define UART_TX_BUFSIZE (256)
+#endif
+
+// Both live in SRAM, 2048 bytes on the ATmega328: the receive buffer
+// takes 3 bytes a slot with its arrival ticks, 96 at 32, and the
+// transmit queue 256.  With their indices and counts the uart holds
+// about 370 bytes, of about 820 the whole firmware keeps in .data and
+// .bss; the rest is left for the stack.
+
+// What to do with a write that does not fit in the transmit queue:
+//   UART_TX_REJECT      - drop the whole new write, keep what is queued
+//   UART_TX_DROP_OLDEST - discard the oldest queued bytes to make room
+#define UART_TX_REJECT      (0)
+#define UART_TX_DROP_OLDEST (1)
+
+#ifndef UART_TX_OVERFLOW
+#define UART_TX_OVERFLOW UART_TX_REJECT
+#endif
+
+// Baud rates the usart can run at.  The UBRR value, double-speed
+// (U2X0) choice and resulting error for each are worked out at compile
+// time for F_CPU in uart.c.
+#define UART_BAUD_9600   (0)
+#define UART_BAUD_19200  (1)
+#define UART_BAUD_38400  (2)
+#define UART_BAUD_57600  (3)
+#define UART_BAUD_115200 (4)
+#define UART_BAUD_COUNT  (5)
+
+// Largest baud rate error, in tenths of a percent, a rate may have to be
+// offered by uart_baud_fastest().
+#ifndef UART_BAUD_MAX_ERROR
+#define UART_BAUD_MAX_ERROR (20)
+#endif
+
+
+void uart_init(uint8_t baudindex);
+
+/** switch baud rate; anything still queued for transmit is garbled */
+void uart_set_baud(uint8_t baudindex);
+
+/** baud index last set by uart_init() or uart_set_baud() */
+uint8_t uart_baud_current();
+
+/** bytes per second a baud index can carry */
+uint16_t uart_baud_cps(uint8_t baudindex);
+
+/** fastest baud index whose error is within UART_BAUD_MAX_ERROR */
+uint8_t uart_baud_fastest();
+
+/** baud rate error of a baud index, in tenths of a percent */
+int8_t uart_baud_error(uint8_t baudindex);
+
+/** digit selecting this rate in the bluetooth module's AT+BAUD command */
+uint8_t uart_baud_at_code(uint8_t baudindex);
+
+/** queue the decimal baud rate of a baud index, e.g. "38400" */
+void uart_sendbaud(uint8_t baudindex);
+
+/** 1 once the transmit queue is empty and the last byte is out */
+uint8_t uart_tx_idle();
+
+
+// All transmit functions only copy into the transmit queue and return;
+// USART_UDRE_vect feeds the bytes to the usart.  They must only be
+// called from the main context, not from interrupt handlers.
+
+/** queue len bytes; returns 0 if rejected by the overflow policy */
+uint8_t uart_write(const uint8_t *data, uint8_t len);
+
+/** same as uart_write(), with data in flash (PROGMEM) */
+uint8_t uart_write_P(const uint8_t *data, uint8_t len);
 
 void uart_sendch(uint8_t ch);
 
+/** number of bytes queued and not yet handed to the usart */
+uint8_t uart_tx_pending();
+
+/** bytes lost to transmit queue overflow, saturates at 0xffff */
+uint16_t uart_tx_dropped();
+
+
+// Line and buffer error counts.  Each saturates at 0xffff.
+struct uart_errors {
+	uint16_t frame;      // stop bit missing (FE0), byte discarded
+	uint16_t overrun;    // bytes lost in the usart before the ISR ran (DOR0)
+	uint16_t parity;     // parity mismatch (UPE0), byte discarded
+	uint16_t rxoverflow; // bytes dropped because the receive buffer was full
+	uint16_t txdropped;  // bytes dropped because the transmit queue was full
+};
+
+/** copy the error counts, and zero them if reset is set */
+void uart_get_errors(struct uart_errors *errors, uint8_t reset);
+
+/** number of received bytes waiting in the ring buffer */
+uint8_t uart_available();
+
+/** next received byte, or -1 if none is waiting; never blocks */
+int16_t uart_read();
+
+/** tick_now() when the byte last returned by uart_read() arrived */
+uint16_t uart_rx_tick();
+
 uint8_t uart_hasch();
 
 uint8_t uart_getch();
@@ -34,7 +140,27 @@ uint8_t uart_expect(char *data);
 
 void uart_send(char *data);
 
+// Variants taking a string in flash, e.g. uart_send_P(PSTR("batt=")),
+// so string constants don't take up SRAM.
+
+uint8_t uart_expect_P(const char *data);
+
+void uart_send_P(const char *data);
+
 void uart_sendint(int16_t v);
 
+void uart_senduint(uint16_t v);
+
+/** decimal with at least width digits, up to 5, zero padded after any sign */
+void uart_sendintw(int16_t v, uint8_t width);
+
+void uart_senduintw(uint16_t v, uint8_t width);
+
+/** two lower-case hex digits */
+void uart_sendhex8(uint8_t v);
+
+/** four lower-case hex digits */
+void uart_sendhex16(uint16_t v);
+
 
 #endif // __uart_h__